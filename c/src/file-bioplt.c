@@ -16,8 +16,20 @@
 //
 // ##### END GPL LICENSE BLOCK #####
 
+#ifdef __linux__
+#define _GNU_SOURCE  // fallocate
+#endif
+
 #include "file-bioplt.h"
 
+#include <glib/gstdio.h>
+#include <errno.h>
+#include <fcntl.h>
+#ifdef G_OS_UNIX
+#include <unistd.h>
+#include <sys/uio.h>
+#include <sys/stat.h>
+#endif
 #include <string.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -29,11 +41,11 @@ static void flip_plt(uint8_t *pixels,
                      const uint32_t height)
 {
     const uint32_t num_rows = height / 2;
-    const uint32_t row_width = width * 2;
+    const gsize row_width = (gsize) width * 2;
     uint8_t* temp = (uint8_t*) g_malloc(sizeof(uint8_t)*row_width);
 
-    int source_offset, target_offset;
-    for (int r = 0; r < num_rows; r++)
+    gsize source_offset, target_offset;
+    for (uint32_t r = 0; r < num_rows; r++)
     {
         source_offset = r * row_width;
         target_offset = (height - r - 1) * row_width;
@@ -47,6 +59,141 @@ static void flip_plt(uint8_t *pixels,
 }
 
 
+static guint64 get_memory_budget(void)
+{
+    const gchar *budget_env = g_getenv("PLT_MEMORY_BUDGET");
+    gchar *budget_end;
+    guint64 budget = 0;
+
+    if (budget_env)
+    {
+        // Plain number of bytes, no suffixes
+        budget = g_ascii_strtoull(budget_env, &budget_end, 10);
+        if (!g_ascii_isdigit(budget_env[0]) || (*budget_end != '\0'))
+        {
+            g_message("Ignoring PLT_MEMORY_BUDGET=%s, expected a number of bytes.\n",
+                      budget_env);
+            budget = 0;
+        }
+    }
+    return (budget > 0) ? budget : PLT_MEMORY_BUDGET;
+}
+
+
+static gint get_band_height(const guint64 row_size, const guint64 reserved,
+                            const gint height)
+{
+    const guint64 tile_height = gimp_tile_height();
+    const guint64 budget = get_memory_budget();
+    guint64 rows = (budget > reserved) ? (budget - reserved) / row_size : 0;
+
+    // Whole rows of tiles, so pixel regions never split a tile
+    rows -= rows % tile_height;
+    if (rows < tile_height)
+        rows = tile_height;
+    if (rows > (guint64) height)
+        rows = height;
+    return (gint) rows;
+}
+
+
+static void align_to_tiles(const gint start, const gint end,
+                           const gint tile_size, const gint limit,
+                           gint *aligned_start, gint *aligned_end)
+{
+    *aligned_start = start - start % tile_size;
+    *aligned_end   = MIN(((end + tile_size - 1) / tile_size) * tile_size, limit);
+}
+
+
+static void set_tile_cache(const gint width)
+{
+    const gint tiles_per_row = (width + gimp_tile_width() - 1) / gimp_tile_width();
+
+    // Each tile is transferred once, so a row of tiles is enough. Twice that
+    // leaves room for the row of the next drawable.
+    gimp_tile_cache_ntiles(2 * tiles_per_row);
+}
+
+
+static gboolean check_image(gint32 image_id)
+{
+    // Only get image data if it's valid
+    if (!gimp_image_is_valid(image_id))
+    {
+        g_message("Invalid image.\n");
+        return FALSE;
+    }
+    // Make sure image is not indexed
+    if (gimp_image_base_type(image_id) == GIMP_INDEXED)
+    {
+        g_message("Image type has to be Grayscale or RGB.\n");
+        return FALSE;
+    }
+    return TRUE;
+}
+
+
+static gchar *strip_extension(const gchar *filename)
+{
+    gchar *basename = g_strdup(filename);
+    gchar *extension = strrchr(basename, '.');
+
+    // Only a dot in the last path component starts an extension
+    if ((extension != NULL) && (strchr(extension, G_DIR_SEPARATOR) == NULL))
+        *extension = '\0';
+    return (basename);
+}
+
+
+// Composite kernels, one for each layer type. The pixel layout is fixed
+// at compile time, so the compiler can unroll and vectorize every variant.
+// Pixels are blended with a byte mask built from the alpha value instead of
+// branched on, a branch in the loop keeps gcc from vectorizing it.
+#define PLT_COMPOSITE_KERNEL(name, bpp, has_alpha, value)                       \
+static void name(uint8_t *restrict plt_data, const guint64 plt_row_size,        \
+                 const uint8_t *restrict layer_data, const gsize layer_row_size,\
+                 const gint width, const gint height,                           \
+                 const uint8_t plt_id)                                          \
+{                                                                               \
+    gint i, j;                                                                  \
+    const uint8_t *px;                                                          \
+    uint8_t *plt_row;                                                           \
+    uint8_t mask;                                                               \
+                                                                                \
+    for (i = 0; i < height; i++)                                                \
+    {                                                                           \
+        plt_row = plt_data + i*plt_row_size;                                    \
+        px = layer_data + i*layer_row_size;                                     \
+        for (j = 0; j < width; j++, px += (bpp))                                \
+        {                                                                       \
+            /* No alpha value means bottom layers are not visible */            \
+            /* i.e. always overwrite everything */                              \
+            mask = (has_alpha) ? -(uint8_t) (px[(bpp)-1] > PLT_ALPHA_THRESHOLD) \
+                               : 0xFF;                                          \
+            plt_row[2*j]   = (plt_row[2*j]   & ~mask) | ((value) & mask);       \
+            plt_row[2*j+1] = (plt_row[2*j+1] & ~mask) | (plt_id  & mask);       \
+        }                                                                       \
+    }                                                                           \
+}
+
+PLT_COMPOSITE_KERNEL(plt_composite_gray,  1, FALSE, px[0])
+PLT_COMPOSITE_KERNEL(plt_composite_graya, 2, TRUE,  px[0])
+PLT_COMPOSITE_KERNEL(plt_composite_rgb,   3, FALSE, (px[0] + px[1] + px[2])/3)
+PLT_COMPOSITE_KERNEL(plt_composite_rgba,  4, TRUE,  (px[0] + px[1] + px[2])/3)
+
+// Indexed by layer type, indexed layers are not supported
+static const PltCompositeFunc plt_composite_kernels[] =
+{
+    [GIMP_RGB_IMAGE]      = plt_composite_rgb,
+    [GIMP_RGBA_IMAGE]     = plt_composite_rgba,
+    [GIMP_GRAY_IMAGE]     = plt_composite_gray,
+    [GIMP_GRAYA_IMAGE]    = plt_composite_graya,
+    [GIMP_INDEXED_IMAGE]  = NULL,
+    [GIMP_INDEXEDA_IMAGE] = NULL
+};
+
+
 static int get_layer_bounds(gint32 image_id, gint32 layer_id, 
                              gint *bx, gint *by, gint *bw, gint *bh)
 {
@@ -62,7 +209,7 @@ static int get_layer_bounds(gint32 image_id, gint32 layer_id,
     {
         *bx = -1 * lay_x;
         if (lay_x + lay_width > img_width)  // layer exceeds image size
-            *bw = lay_width;
+            *bw = img_width;
         else if (lay_x + lay_width > 0)  // layer partially within image
             *bw = lay_x + lay_width;
         else  // layer out of bounds
@@ -82,8 +229,8 @@ static int get_layer_bounds(gint32 image_id, gint32 layer_id,
     if (lay_y < 0)
     {
         *by = -1 * lay_y;
-        if (lay_y + lay_height > img_width)  // layer exceeds image size
-            *bh = lay_height;
+        if (lay_y + lay_height > img_height)  // layer exceeds image size
+            *bh = img_height;
         else if (lay_y + lay_height > 0)  // layer partially within image
             *bh = lay_y + lay_height;
         else  // layer out of bounds
@@ -104,6 +251,45 @@ static int get_layer_bounds(gint32 image_id, gint32 layer_id,
 }
 
 
+static gboolean init_source(PltSource *source, gint32 image_id,
+                            gint32 layer_id, gint plt_id, guint32 variants)
+{
+    gint layer_x, layer_y;
+    gint region_x, region_y, region_w, region_h;  // part of the region to get
+    GimpImageType layer_type;
+
+    if (!get_layer_bounds(image_id, layer_id, &region_x, &region_y, &region_w, &region_h))
+        return FALSE;
+    // Pick the kernel once for the whole layer
+    layer_type = gimp_drawable_type(layer_id);
+    if (((guint) layer_type >= G_N_ELEMENTS(plt_composite_kernels)) ||
+        (plt_composite_kernels[layer_type] == NULL))
+        return FALSE;
+    source->composite = plt_composite_kernels[layer_type];
+
+    source->layer_id  = layer_id;
+    source->plt_id    = plt_id;
+    source->variants  = variants;
+    source->drawable  = gimp_drawable_get(layer_id);
+    source->bpp       = gimp_drawable_bpp(layer_id);
+    source->lx        = region_x;
+    source->ly        = region_y;
+    source->width     = region_w;
+    source->height    = region_h;
+    // Whole layer, reads are aligned to its tiles
+    gimp_pixel_rgn_init(&source->region, source->drawable,
+                        0, 0,
+                        source->drawable->width, source->drawable->height,
+                        FALSE, FALSE);
+    gimp_drawable_offsets(layer_id, &layer_x, &layer_y);
+    // layer bounds are already adjusted to adress layers being out of bounds
+    // we still need to adjust plt pixel index 
+    source->x = (layer_x > 0) ? layer_x : 0;
+    source->y = (layer_y > 0) ? layer_y : 0;
+    return TRUE;
+}
+
+
 static void query(void)
 {
     // Load procedure arguments
@@ -168,6 +354,36 @@ static void query(void)
     gimp_register_file_handler_mime(SAVE_PROCEDURE, "image/plt");
     gimp_register_save_handler(SAVE_PROCEDURE, "plt", "");
 
+    // Save procedure with options, the save procedure keeps the standard
+    // arguments of save handlers for existing scripts
+    static const GimpParamDef save2_args[] =
+    {
+        {GIMP_PDB_INT32,    (gchar*)"run-mode",      (gchar*)"Interactive, non-interactive" },
+        {GIMP_PDB_IMAGE,    (gchar*)"image",         (gchar*)"Input image" },
+        {GIMP_PDB_DRAWABLE, (gchar*)"drawable",      (gchar*)"Drawable to save" },
+        {GIMP_PDB_STRING,   (gchar*)"filename",      (gchar*)"The name of the file to save the image in" },
+        {GIMP_PDB_STRING,   (gchar*)"raw-filename",  (gchar*)"The name entered" },
+        {GIMP_PDB_INT32,    (gchar*)"mipmaps",       (gchar*)"Also save the mipmap chain as <filename>_mip<level>.plt (TRUE, FALSE)" },
+        {GIMP_PDB_STRING,   (gchar*)"base-filename", (gchar*)"Save as delta plt, only storing the tiles which differ from this plt (relative to filename)" }
+    };
+
+    // Install save procedure with options
+    gimp_install_procedure(SAVE2_PROCEDURE,
+                           "Save a Packed Layer Texture (.plt)",
+                           "Save a Packed Layer Texture (.plt), optionally "
+                           "with its mipmap chain or as a delta plt. Same as "
+                           "file-bioplt-save with additional options.",
+                           "Attila Gyoerkoes",
+                           "GPL v3",
+                           "2016",
+                           NULL,
+                           "RGB*",
+                           GIMP_PLUGIN,
+                           G_N_ELEMENTS(save2_args),
+                           0,
+                           save2_args,
+                           NULL);
+
      // Add Layers procedure arguments
     static const GimpParamDef addl_args[] =
     {
@@ -191,6 +407,34 @@ static void query(void)
                            NULL);
     // Register Add Layers handlers
     gimp_plugin_menu_register(ADDL_PROCEDURE, "<Image>/Tools");
+
+    // Save Variants procedure arguments
+    static const GimpParamDef variants_args[] =
+    {
+        {GIMP_PDB_INT32,  (gchar*)"run-mode", (gchar*)"Interactive, non-interactive" },
+        {GIMP_PDB_IMAGE,  (gchar*)"image",    (gchar*)"Input image" },
+        {GIMP_PDB_STRING, (gchar*)"filename", (gchar*)"Base name of the files to save the variants in, defaults to the image filename" }
+    };
+
+    // Install Save Variants procedure
+    gimp_install_procedure(VARIANTS_PROCEDURE,
+                           "Save each layer group as a Packed Layer Texture (.plt)",
+                           "Save each top level layer group as a separate "
+                           "Packed Layer Texture named <filename>-<group>.plt. "
+                           "Plt layers outside of groups are shared by all "
+                           "variants.",
+                           "Attila Gyoerkoes",
+                           "GPL v3",
+                           "2016",
+                           "Plt: Save Variants",
+                           "RGB*, GRAY*",
+                           GIMP_PLUGIN,
+                           G_N_ELEMENTS(variants_args),
+                           0,
+                           variants_args,
+                           NULL);
+    // Register Save Variants handlers
+    gimp_plugin_menu_register(VARIANTS_PROCEDURE, "<Image>/Tools");
 }
 
 
@@ -214,6 +458,7 @@ static void run(const gchar      *name,
 
     gint32 image_id;
     gint32 drawable_id;
+    PltSaveVals save_vals = {FALSE};
 
     /* Get run_mode - don't display a dialog if in NONINTERACTIVE mode */
     run_mode = (GimpRunMode) param[0].data.d_int32;
@@ -242,24 +487,35 @@ static void run(const gchar      *name,
             return_values[1].data.d_image = image_id;
         }
     }
-    else if (!g_strcmp0(name, SAVE_PROCEDURE))
+    else if (!g_strcmp0(name, SAVE_PROCEDURE) || !g_strcmp0(name, SAVE2_PROCEDURE))
     {
         image_id    = param[1].data.d_int32;
         drawable_id = param[2].data.d_int32;
 
-        // No import options/interactivity right now, so every run mode is
-        // handled the same way
+        // No export dialog right now, so interactive saves keep the
+        // defaults. Only repeated saves use the options of the last one.
         switch (run_mode)
         {
             case GIMP_RUN_INTERACTIVE:
+                break;
             case GIMP_RUN_WITH_LAST_VALS:
+                gimp_get_data(SAVE_PROCEDURE, &save_vals);
+                break;
             case GIMP_RUN_NONINTERACTIVE:
             default:
-                status = plt_save(param[3].data.d_string, image_id);
+                if (!g_strcmp0(name, SAVE2_PROCEDURE))
+                    save_vals.mipmaps = param[5].data.d_int32;
                 break;
         }
+        // Deltas are only saved on request, the base is not kept between runs
+        status = plt_save(param[3].data.d_string, image_id, save_vals.mipmaps,
+                          ((run_mode == GIMP_RUN_NONINTERACTIVE) &&
+                           !g_strcmp0(name, SAVE2_PROCEDURE)) ?
+                          param[6].data.d_string : NULL);
 
         return_values[0].data.d_status = status;
+        if (status == GIMP_PDB_SUCCESS)
+            gimp_set_data(SAVE_PROCEDURE, &save_vals, sizeof(PltSaveVals));
     }
     else if (!g_strcmp0(name, ADDL_PROCEDURE))
     {
@@ -280,6 +536,26 @@ static void run(const gchar      *name,
 
         return_values[0].data.d_status = status;
     }
+    else if (!g_strcmp0(name, VARIANTS_PROCEDURE))
+    {
+        image_id = param[1].data.d_int32;
+
+        // Menu invocations don't pass a filename
+        switch (run_mode)
+        {
+            case GIMP_RUN_INTERACTIVE:
+            case GIMP_RUN_WITH_LAST_VALS:
+                status = plt_save_variants(NULL, image_id);
+                break;
+            case GIMP_RUN_NONINTERACTIVE:
+            default:
+                status = plt_save_variants((nparams > 2) ? param[2].data.d_string : NULL,
+                                           image_id);
+                break;
+        }
+
+        return_values[0].data.d_status = status;
+    }
     else
     {
         return_values[0].data.d_status = GIMP_PDB_CALLING_ERROR;
@@ -290,24 +566,29 @@ static void run(const gchar      *name,
 static GimpPDBStatusType plt_load(gchar *filename, gint32 *image_id)
 {
     FILE *stream = 0;
-    unsigned int i, j;
+    GStatBuf stream_info;
+    unsigned int i;
+    guint64 j;
 
     // Using uint instead of guint for guaranteed sizes
     // (not 100% sure if guint works)
     uint8_t  plt_version[8];
     uint32_t plt_width  = 0;
     uint32_t plt_height = 0;
-    uint32_t plt_num_px;
+    guint64  plt_num_px;    // 64 bit, 2*width*height overflows 32 bit
+    guint64  plt_row_size;  // bytes per row, same for plt and layer data
     uint8_t *plt_data;
-    
+    uint8_t *delta_data = NULL;  // complete plt data of delta plts
+    gboolean is_delta;
+
     uint8_t *layer_data;
-    gint32 layer_id = -1;
-    gint32 plt_layer_ids[PLT_NUM_LAYERS];
-    
+    gint32 layer_ids[PLT_NUM_LAYERS];
+    GimpDrawable *drawables[PLT_NUM_LAYERS];
+    GimpPixelRgn  regions[PLT_NUM_LAYERS];
+
     gint32 img_id = -1;
-    GimpPixelRgn region;
-    GimpDrawable *drawable;
-    guint8 pixel[2] = {0, 255}; // GRAYA image = 2 Channels: Value + Alpha
+    gint band_height, band_rows, band_y, num_bands, band;
+    gboolean band_error;
 
     stream = fopen(filename, "rb");
     if(stream == 0)
@@ -326,7 +607,8 @@ static GimpPDBStatusType plt_load(gchar *filename, gint32 *image_id)
         fclose(stream);
         return (GIMP_PDB_EXECUTION_ERROR);
     }
-    if (g_ascii_strncasecmp(plt_version, PLT_HEADER_VERSION, 8) != 0)
+    is_delta = (g_ascii_strncasecmp(plt_version, PLT_DELTA_VERSION, 8) == 0);
+    if (!is_delta && (g_ascii_strncasecmp(plt_version, PLT_HEADER_VERSION, 8) != 0))
     {
 
         g_message("Invalid plt file: Version mismatch.\n");
@@ -350,128 +632,163 @@ static GimpPDBStatusType plt_load(gchar *filename, gint32 *image_id)
         return (GIMP_PDB_EXECUTION_ERROR);
     }
 
+    // Validate header before allocating anything
+    // Expecting width*height (value, layer) tuples = 2*width*height bytes
+    if ((plt_width  == 0) || (plt_width  > GIMP_MAX_IMAGE_SIZE) ||
+        (plt_height == 0) || (plt_height > GIMP_MAX_IMAGE_SIZE))
+    {
+        g_message("Invalid plt file: Unsupported image size %ux%u.\n",
+                  plt_width, plt_height);
+        fclose(stream);
+        return (GIMP_PDB_EXECUTION_ERROR);
+    }
+    plt_num_px = (guint64) plt_width * (guint64) plt_height;
+    if (is_delta)
+    {
+        // Delta plts are applied to their base in memory and then
+        // processed like a regular plt
+        delta_data = plt_read_delta(stream, filename, plt_width, plt_height);
+        if (delta_data == NULL)
+        {
+            fclose(stream);
+            return (GIMP_PDB_EXECUTION_ERROR);
+        }
+    }
+    else if ((g_stat(filename, &stream_info) != 0) ||
+             ((guint64) stream_info.st_size < PLT_HEADER_SIZE + 2*plt_num_px))
+    {
+        g_message("Image size mismatch.\n");
+        fclose(stream);
+        return (GIMP_PDB_EXECUTION_ERROR);
+    }
+
     // Create a new image
     img_id = gimp_image_new(plt_width, plt_height, GIMP_GRAY);
     if(img_id == -1)
     {
         g_message("Unable to allocate new image.\n");
         fclose(stream);
+        g_free(delta_data);
         return (GIMP_PDB_EXECUTION_ERROR);
     }
     gimp_image_set_filename(img_id, filename);
+    // Nothing to undo on a new image
+    gimp_image_undo_disable(img_id);
 
-    // Read image data
-    // Expecting width*height (value, layer) tuples = 2*width*height bytes
-    plt_num_px = plt_width * plt_height;
-    plt_data = (uint8_t*) g_malloc(sizeof(uint8_t)*2*plt_num_px);
-    if (fread(plt_data, 1, 2*plt_num_px, stream) < (2*plt_num_px))
+    // Create layers, they are only inserted when completely filled, so the
+    // image projection is not updated for each band
+    for (i = 0; i < PLT_NUM_LAYERS; i++)
     {
-        g_message("Image size mismatch.\n");
-        fclose(stream);
-        g_free(plt_data);
-        gimp_image_delete(img_id);
-        return (GIMP_PDB_EXECUTION_ERROR);
+        layer_ids[i] = gimp_layer_new(img_id,
+                                      PLT_LAYERS[i],
+                                      plt_width, plt_height,
+                                      GIMP_GRAYA_IMAGE,
+                                      100.0,
+                                      GIMP_NORMAL_MODE);
+        drawables[i] = gimp_drawable_get(layer_ids[i]);
+        gimp_pixel_rgn_init (&regions[i], drawables[i],
+                             0, 0, plt_width, plt_height,
+                             TRUE, FALSE);
     }
-    fclose(stream);
 
-    // Write data into layers
-    layer_data = (uint8_t*) g_malloc(sizeof(uint8_t)*2*plt_num_px);
+    // Write data into layers, a band of rows at a time to stay within the
+    // memory budget. The plt is stored bottom-up, so going through the
+    // bands from the bottom of the image reads the file sequentially.
+    plt_row_size = 2 * (guint64) plt_width;
+    band_height  = get_band_height(2*plt_row_size, 0, plt_height);
+    num_bands    = (plt_height + band_height - 1) / band_height;
+    set_tile_cache(plt_width);
+    plt_data   = (uint8_t*) g_malloc(sizeof(uint8_t)*plt_row_size*band_height);
+    layer_data = (uint8_t*) g_malloc(sizeof(uint8_t)*plt_row_size*band_height);
+    band_error = FALSE;
     gimp_progress_update(0.0);
-    for (i = 0; i < PLT_NUM_LAYERS; i++)
+    for (band = num_bands; band-- > 0; )
     {
-        layer_id = gimp_layer_new(img_id,
-                                  PLT_LAYERS[i],
-                                  plt_width, plt_height,
-                                  GIMP_GRAYA_IMAGE,
-                                  100.0,
-                                  GIMP_NORMAL_MODE);
-        drawable = gimp_drawable_get(layer_id);
-        gimp_pixel_rgn_init (&region, drawable,
-                             0, 0, plt_width, plt_height,
-                             TRUE, FALSE);
-        // Grab the pixels belonging to this layer
-        for (j = 0; j < 2*plt_num_px; j+=2)
+        band_y    = band * band_height;
+        band_rows = MIN(band_height, (gint) plt_height - band_y);
+        if (delta_data)
         {
-            if (plt_data[j+1] == i)
-            {
-                layer_data[j] = plt_data[j];
-                layer_data[j+1] = 255;
-            }
-            else
+            memcpy(plt_data, delta_data + plt_row_size*(plt_height - band_y - band_rows),
+                   plt_row_size*band_rows);
+        }
+        else if (fread(plt_data, 1, plt_row_size*band_rows, stream) < plt_row_size*band_rows)
+        {
+            band_error = TRUE;
+            break;
+        }
+        // Adjust coordinate systems
+        flip_plt(plt_data, plt_width, band_rows);
+        for (i = 0; i < PLT_NUM_LAYERS; i++)
+        {
+            // Grab the pixels belonging to this layer
+            for (j = 0; j < plt_row_size*band_rows; j+=2)
             {
-                layer_data[j] = 0;
-                layer_data[j+1] = 0;
+                if (plt_data[j+1] == i)
+                {
+                    layer_data[j] = plt_data[j];
+                    layer_data[j+1] = 255;
+                }
+                else
+                {
+                    layer_data[j] = 0;
+                    layer_data[j+1] = 0;
+                }
             }
+            gimp_pixel_rgn_set_rect(&regions[i],
+                                    layer_data,
+                                    0, band_y,
+                                    plt_width, band_rows);
         }
-        gimp_pixel_rgn_set_rect(&region,
-                                layer_data,
-                                0, 0,
-                                plt_width, plt_height);
-        gimp_drawable_flush(drawable);
-        gimp_drawable_detach(drawable);
-        gimp_image_insert_layer(img_id, layer_id, 0, 0);
-        gimp_progress_update((float) i/ (float) PLT_NUM_LAYERS);
+        gimp_progress_update((float) (num_bands - band)/ (float) num_bands);
+    }
+    fclose(stream);
+    for (i = 0; i < PLT_NUM_LAYERS; i++)
+    {
+        gimp_drawable_flush(drawables[i]);
+        gimp_drawable_detach(drawables[i]);
     }
-    gimp_progress_update(1.0);
-    gimp_image_set_active_layer(img_id, layer_id);
     // Cleanup
     g_free(layer_data);
     g_free(plt_data);
-    // Adjust coordinate systems
-    gimp_image_flip(img_id, GIMP_ORIENTATION_VERTICAL);
+    g_free(delta_data);
+    if (band_error)
+    {
+        g_message("Image size mismatch.\n");
+        for (i = 0; i < PLT_NUM_LAYERS; i++)
+            gimp_item_delete(layer_ids[i]);
+        gimp_image_delete(img_id);
+        return (GIMP_PDB_EXECUTION_ERROR);
+    }
+    for (i = 0; i < PLT_NUM_LAYERS; i++)
+        gimp_image_insert_layer(img_id, layer_ids[i], 0, 0);
+    gimp_progress_update(1.0);
+    gimp_image_set_active_layer(img_id, layer_ids[PLT_NUM_LAYERS-1]);
+    gimp_image_undo_enable(img_id);
     *image_id = img_id;
     return (GIMP_PDB_SUCCESS);
 }
 
 
-static GimpPDBStatusType plt_save(gchar *filename, gint32 image_id)
+static GimpPDBStatusType plt_save(gchar *filename, gint32 image_id,
+                                  gboolean mipmaps, gchar *base_filename)
 {
-    FILE *stream = 0;
-    unsigned int i, j, k, l;
-
-    uint8_t  plt_version[8] = PLT_HEADER_VERSION;
-    uint8_t  plt_info[8] = {10, 0, 0, 0, 0, 0, 0, 0};
-    uint32_t plt_width  = 0;
-    uint32_t plt_height = 0;
-    uint8_t *plt_data;
+    unsigned int i, l;
 
     gint layer_id;
-    gint layer_x, layer_y;
-    uint8_t *layer_data;
     gchar *layer_name;
-    
-    uint32_t plt_num_px;
+
     gint32 detected_layers;
-    gint bpp;
 
     gint img_num_layers; // num layers in image
     gint *img_layer_ids; // all layers in image
     gint *plt_layer_ids; // valid plt layers
-    gint plt_id;
-    
-    
-    GimpImageBaseType img_basetype;
-    GimpDrawable *drawable;
-    GimpPixelRgn region;
-    gint region_x, region_y, region_w, region_h;  // part of the region to get
-    
-    // Only get image data if it's valid
-    if (!gimp_image_is_valid(image_id))
-    {
-        g_message("Invalid image.\n");
-        return (GIMP_PDB_EXECUTION_ERROR);
-    }
-    plt_width = gimp_image_width(image_id);
-    plt_height = gimp_image_height(image_id);
-    img_basetype = gimp_image_base_type(image_id);
+    GArray *sources;     // plt layers with pixels inside the image
+    PltSource source;
+    PltVariant variant;
+    GimpPDBStatusType status;
 
-    // Make sure image is not indexed
-    img_basetype = gimp_image_base_type(image_id);
-    if (img_basetype == GIMP_INDEXED)
-    {
-        g_message("Image type has to be Grayscale or RGB.\n");
+    if (!check_image(image_id))
         return (GIMP_PDB_EXECUTION_ERROR);
-    }
 
     //  Determine which gimp layer to use for which plt layer
     img_layer_ids = gimp_image_get_layers(image_id, &img_num_layers);
@@ -502,7 +819,7 @@ static GimpPDBStatusType plt_save(gchar *filename, gint32 image_id)
     */
     // Start with the top layer to reflect what is displayed in gimp
     // (NOTE: layer names are unique, so no problems with duplicates)
-    for (l = 0; l < img_num_layers; l++)
+    for (l = 0; ((l < img_num_layers) && (detected_layers < PLT_NUM_LAYERS)); l++)
     {
         layer_name = gimp_item_get_name(img_layer_ids[l]);
         for (i = 0; i < PLT_NUM_LAYERS; i++)
@@ -528,178 +845,1073 @@ static GimpPDBStatusType plt_save(gchar *filename, gint32 image_id)
         }
     }
     g_free(img_layer_ids);
-            
-    // Init image data
-    plt_num_px = plt_width * plt_height;
-    plt_data = (uint8_t*) g_malloc(sizeof(uint8_t)*2*plt_num_px);
-    for (i = 0; i < 2*plt_num_px; i+=2)
+
+    // Keep only the layers with pixels inside the image
+    sources = g_array_new(FALSE, FALSE, sizeof(PltSource));
+    for (l = 0; l < PLT_NUM_LAYERS; l++)
+    {
+        layer_id = plt_layer_ids[l+PLT_NUM_LAYERS];
+        if ((layer_id >= 0) && init_source(&source, image_id, layer_id, plt_layer_ids[l], 1))
+            g_array_append_val(sources, source);
+    }
+    g_free(plt_layer_ids);
+
+    variant.filename = filename;
+    variant.mipmaps  = mipmaps;
+    variant.base_filename = ((base_filename != NULL) && (base_filename[0] != '\0')) ? base_filename : NULL;
+    status = plt_write_variants(image_id,
+                                (PltSource*) sources->data, sources->len,
+                                &variant, 1);
+
+    for (l = 0; l < sources->len; l++)
+        gimp_drawable_detach(g_array_index(sources, PltSource, l).drawable);
+    g_array_free(sources, TRUE);
+
+    return (status);
+}
+
+
+static void plt_make_header(uint8_t *header, const gchar *version,
+                            const uint32_t width, const uint32_t height)
+{
+    const uint8_t plt_info[8] = {10, 0, 0, 0, 0, 0, 0, 0};
+
+    memcpy(header, version, 8);
+    memcpy(header + 8, plt_info, 8);
+    memcpy(header + 16, &width, 4);
+    memcpy(header + 20, &height, 4);
+}
+
+
+static gchar *resolve_symlinks(const gchar *filename)
+{
+    gint i;
+    gchar *result = g_strdup(filename);
+    gchar *target;
+    gchar *dirname;
+
+    for (i = 0; (i < PLT_MAX_SYMLINKS) && g_file_test(result, G_FILE_TEST_IS_SYMLINK); i++)
+    {
+        target = g_file_read_link(result, NULL);
+        if (target == NULL)
+            break;
+        // Relative links start from the directory of the link
+        if (!g_path_is_absolute(target))
+        {
+            dirname = g_path_get_dirname(result);
+            g_free(result);
+            result = g_build_filename(dirname, target, NULL);
+            g_free(dirname);
+            g_free(target);
+        }
+        else
+        {
+            g_free(result);
+            result = target;
+        }
+    }
+    return (result);
+}
+
+
+// Keeps the first error, later calls may overwrite errno before it is
+// reported
+static void plt_writer_fail(PltWriter *writer, const gint error_code)
+{
+    if (!writer->error)
+        writer->error_code = error_code;
+    writer->error = TRUE;
+}
+
+
+static gboolean plt_writer_open(PltWriter *writer, const gchar *filename,
+                                const guint64 size)
+{
+#ifdef G_OS_UNIX
+    struct stat target_stat;
+#endif
+
+    // Write to a temporary file next to the target, which replaces the
+    // target only once it is complete. Symlinks are kept, their target
+    // is replaced.
+    writer->filename = resolve_symlinks(filename);
+    writer->temp_filename = g_strconcat(writer->filename, ".XXXXXX", NULL);
+    writer->error = FALSE;
+#ifdef G_OS_UNIX
+    writer->fd = g_mkstemp_full(writer->temp_filename, O_WRONLY, 0666);
+    if ((writer->fd >= 0) && (stat(writer->filename, &target_stat) == 0) &&
+        ((fchmod(writer->fd, target_stat.st_mode & 07777) != 0) ||
+         // Keep the group of the file being replaced. Only possible if the
+         // user belongs to it, otherwise the default group stays.
+         ((fchown(writer->fd, -1, target_stat.st_gid) != 0) && (errno != EPERM))))
+    {
+        g_message("Error copying permissions of %s: %s\n", filename, g_strerror(errno));
+        close(writer->fd);
+        g_remove(writer->temp_filename);
+        g_free(writer->temp_filename);
+        g_free(writer->filename);
+        return FALSE;
+    }
+    if (writer->fd < 0)
+#else
+    writer->fd = g_mkstemp(writer->temp_filename);
+    writer->stream = (writer->fd >= 0) ? fdopen(writer->fd, "wb") : 0;
+    if (writer->stream == 0)
+#endif
     {
-        plt_data[i] = 255;
-        plt_data[i+1] = 0;
+        g_message("Error opening %s: %s\n", filename, g_strerror(errno));
+        g_free(writer->temp_filename);
+        g_free(writer->filename);
+        return FALSE;
     }
+#ifdef __linux__
+    // Reserve the whole file at once to avoid fragmentation, not all file
+    // systems support this
+    if (size > 0)
+        fallocate(writer->fd, 0, 0, size);
+#endif
+    return TRUE;
+}
+
+
+static gboolean plt_writer_writev(PltWriter *writer,
+                                  const PltChunk *chunks, const gint num_chunks)
+{
+    gint i;
+#ifdef G_OS_UNIX
+    struct iovec iov[PLT_WRITE_CHUNKS];
+    gint first = 0;    // first chunk not written completely
+    gsize offset = 0;  // bytes of it already written
+    gint count;
+    gssize written;
 
-    // Generate image data
+    // Several chunks per call, continue after short writes
+    while (!writer->error)
+    {
+        // Skip written chunks, empty ones included
+        while ((first < num_chunks) && (offset == chunks[first].size))
+        {
+            first++;
+            offset = 0;
+        }
+        if (first == num_chunks)
+            break;
+        count = MIN(num_chunks - first, PLT_WRITE_CHUNKS);
+        for (i = 0; i < count; i++)
+        {
+            iov[i].iov_base = (void*) chunks[first + i].data;
+            iov[i].iov_len  = chunks[first + i].size;
+        }
+        iov[0].iov_base = (uint8_t*) iov[0].iov_base + offset;
+        iov[0].iov_len -= offset;
+        written = writev(writer->fd, iov, count);
+        if (written < 0)
+        {
+            if (errno != EINTR)
+                plt_writer_fail(writer, errno);
+            continue;
+        }
+        // Nothing written although there was data left
+        if (written == 0)
+        {
+            plt_writer_fail(writer, EIO);
+            continue;
+        }
+        for (i = 0; (i < count) && ((gsize) written >= iov[i].iov_len); i++)
+            written -= iov[i].iov_len;
+        offset = (i == 0) ? offset + written : written;
+        first += i;
+    }
+#else
+    for (i = 0; !writer->error && (i < num_chunks); i++)
+    {
+        if (fwrite(chunks[i].data, 1, chunks[i].size, writer->stream) < chunks[i].size)
+            plt_writer_fail(writer, errno);
+    }
+#endif
+    return (!writer->error);
+}
+
+
+static gboolean plt_writer_write(PltWriter *writer,
+                                 const uint8_t *header, const gsize header_size,
+                                 const uint8_t *data, const gsize data_size)
+{
+    PltChunk chunks[2];
+
+    chunks[0].data = header;
+    chunks[0].size = header_size;
+    chunks[1].data = data;
+    chunks[1].size = data_size;
+    return (plt_writer_writev(writer, chunks, 2));
+}
+
+
+static gboolean plt_writer_close(PltWriter *writer, const gboolean commit,
+                                 GPtrArray *dirs)
+{
+    gboolean result;
+#ifdef G_OS_UNIX
+    gchar *dirname;
+    guint i;
+
+    // Data has to be on disk before the rename makes it visible
+    if (commit && !writer->error && (fsync(writer->fd) != 0))
+        plt_writer_fail(writer, errno);
+    if (close(writer->fd) != 0)
+        plt_writer_fail(writer, errno);
+#else
+    if (commit && !writer->error && (fflush(writer->stream) != 0))
+        plt_writer_fail(writer, errno);
+    if (fclose(writer->stream) != 0)
+        plt_writer_fail(writer, errno);
+    // Windows can't rename onto an existing file
+    if (commit && !writer->error)
+        g_remove(writer->filename);
+#endif
+    if (commit && !writer->error &&
+        (g_rename(writer->temp_filename, writer->filename) != 0))
+        plt_writer_fail(writer, errno);
+    result = commit && !writer->error;
+    if (!result)
+    {
+        if (commit)
+            g_message("Error writing %s: %s\n", writer->filename,
+                      g_strerror(writer->error_code));
+        g_remove(writer->temp_filename);
+    }
+#ifdef G_OS_UNIX
+    else if (dirs != NULL)
+    {
+        // The directory is synced once all files of the save are renamed
+        dirname = g_path_get_dirname(writer->filename);
+        for (i = 0; i < dirs->len; i++)
+        {
+            if (!g_strcmp0(g_ptr_array_index(dirs, i), dirname))
+                break;
+        }
+        if (i < dirs->len)
+            g_free(dirname);
+        else
+            g_ptr_array_add(dirs, dirname);
+    }
+#endif
+    g_free(writer->temp_filename);
+    g_free(writer->filename);
+    return (result);
+}
+
+
+// Makes the renames of plt_writer_close persistent
+static void plt_sync_dirs(GPtrArray *dirs)
+{
+#ifdef G_OS_UNIX
+    guint i;
+    gint dir_fd;
+
+    for (i = 0; i < dirs->len; i++)
+    {
+        dir_fd = open(g_ptr_array_index(dirs, i), O_RDONLY);
+        if (dir_fd >= 0)
+        {
+            fsync(dir_fd);
+            close(dir_fd);
+        }
+    }
+#endif
+    g_ptr_array_free(dirs, TRUE);
+}
+
+
+// Reduces 2x2 plt pixels to one. Layer ids can't be interpolated, so the
+// most frequent one is used (first one on a tie) and only the values of
+// its pixels are averaged. Everything is selected with masks instead of
+// branched on, so the loops calling this can be vectorized.
+static inline void plt_downsample_block(const uint8_t *p0, const uint8_t *p1,
+                                        const uint8_t *p2, const uint8_t *p3,
+                                        uint8_t *dst)
+{
+    const uint8_t e01 = (p0[1] == p1[1]), e02 = (p0[1] == p2[1]), e03 = (p0[1] == p3[1]);
+    const uint8_t e12 = (p1[1] == p2[1]), e13 = (p1[1] == p3[1]), e23 = (p2[1] == p3[1]);
+    const uint8_t count0 = 1 + e01 + e02 + e03;
+    const uint8_t count1 = 1 + e01 + e12 + e13;
+    const uint8_t count2 = 1 + e02 + e12 + e23;
+    const uint8_t count3 = 1 + e03 + e13 + e23;
+    uint8_t count = count0;
+    uint8_t id = p0[1];
+    uint8_t mask;
+    uint16_t sum, third;
+
+    // Masks are all ones where the condition holds. Types are kept as
+    // narrow as the values allow, so more pixels fit into a vector.
+    mask  = -(uint8_t) (count1 > count);
+    id    = (p1[1] & mask) | (id & ~mask);
+    count = (count1 & mask) | (count & ~mask);
+    mask  = -(uint8_t) (count2 > count);
+    id    = (p2[1] & mask) | (id & ~mask);
+    count = (count2 & mask) | (count & ~mask);
+    mask  = -(uint8_t) (count3 > count);
+    id    = (p3[1] & mask) | (id & ~mask);
+    count = (count3 & mask) | (count & ~mask);
+    sum = (uint16_t) (p0[0] & -(uint8_t) (p0[1] == id)) +
+          (uint16_t) (p1[0] & -(uint8_t) (p1[1] == id)) +
+          (uint16_t) (p2[0] & -(uint8_t) (p2[1] == id)) +
+          (uint16_t) (p3[0] & -(uint8_t) (p3[1] == id));
+    // Rounded sum/count. sum + 1 is at most 1021, far below where
+    // 43691/2^17 stops being exact for 1/3.
+    third = ((guint) (uint16_t) (sum + 1) * 43691u) >> 17;
+    dst[0] = (((sum + 2) >> 2) & -(uint16_t) (count == 4)) |
+             (third            & -(uint16_t) (count == 3)) |
+             (((sum + 1) >> 1) & -(uint16_t) (count == 2)) |
+             (sum              & -(uint16_t) (count == 1));
+    dst[1] = id;
+}
+
+
+// Halves a block of plt data, dst may be src. Every destination pixel is
+// written after its source pixels have been read, and never lies after them.
+static void plt_downsample(const uint8_t *src, const uint32_t src_width, const gint src_height,
+                           uint8_t *dst, const uint32_t dst_width, const gint dst_height)
+{
+    gint i;
+    gsize j;  // 64-bit, so gcc sees the addresses as linear in j
+    const gsize inner_width = MIN(dst_width, src_width / 2);  // no clamping needed
+    const uint8_t *row0, *row1;
+    uint8_t *dst_row;
+    gsize col0, col1;
+
+    for (i = 0; i < dst_height; i++)
+    {
+        row0 = src + 2 * (gsize) src_width * MIN(2*i, src_height-1);
+        row1 = src + 2 * (gsize) src_width * MIN(2*i+1, src_height-1);
+        dst_row = dst + 2 * (gsize) dst_width * i;
+        for (j = 0; j < inner_width; j++)
+            plt_downsample_block(row0 + 4*j, row0 + 4*j + 2, row1 + 4*j, row1 + 4*j + 2,
+                                 dst_row + 2*j);
+        // Sources of a single column repeat it
+        for (; j < dst_width; j++)
+        {
+            col0 = 2 * MIN(2*j, src_width-1);
+            col1 = 2 * MIN(2*j+1, src_width-1);
+            plt_downsample_block(row0 + col0, row0 + col1, row1 + col0, row1 + col1,
+                                 dst_row + 2*j);
+        }
+    }
+}
+
+
+static gboolean plt_write_file(const gchar *filename, uint8_t *plt_data,
+                               const uint32_t width, const uint32_t height,
+                               GPtrArray *dirs)
+{
+    PltWriter writer;
+    uint8_t plt_header[PLT_HEADER_SIZE];
+    const gsize plt_size = 2 * (gsize) width * height;
+    gboolean result;
+
+    if (!plt_writer_open(&writer, filename, PLT_HEADER_SIZE + plt_size))
+        return FALSE;
+    // Adjust coordinates
+    flip_plt(plt_data, width, height);
+    plt_make_header(plt_header, PLT_HEADER_VERSION, width, height);
+    result = plt_writer_write(&writer, plt_header, PLT_HEADER_SIZE, plt_data, plt_size);
+    result = plt_writer_close(&writer, result, dirs);
+    // Restore coordinates, the data may be used for the next mip level
+    flip_plt(plt_data, width, height);
+    return (result);
+}
+
+
+static gboolean plt_write_mipmaps(const PltVariant *variant, GPtrArray *dirs)
+{
+    gint level;
+    uint32_t width  = MAX(1, variant->width / 2);
+    uint32_t height = MAX(1, variant->height / 2);
+    gchar *basename;
+    gchar *filename;
+    gboolean result = TRUE;
+
+    basename = strip_extension(variant->filename);
+
+    // Level 1 has been built while saving, the others replace the previous
+    // level in the same buffer
+    for (level = 1; result; level++)
+    {
+        filename = g_strdup_printf("%s_mip%d.plt", basename, level);
+        result = plt_write_file(filename, variant->mip_data, width, height, dirs);
+        g_free(filename);
+        if ((width == 1) && (height == 1))
+            break;
+        plt_downsample(variant->mip_data, width, height,
+                       variant->mip_data, MAX(1, width/2), MAX(1, height/2));
+        width  = MAX(1, width/2);
+        height = MAX(1, height/2);
+    }
+    g_free(basename);
+    return (result);
+}
+
+
+static void write_variant_band(gpointer data, gpointer user_data)
+{
+    PltVariant *variant = (PltVariant*) data;
+    PltBandWriter *band_writer = (PltBandWriter*) user_data;
+    const gsize band_size = 2 * (gsize) variant->width * variant->band_rows;
+    const uint32_t mip_width  = MAX(1, variant->width / 2);
+    const uint32_t mip_height = MAX(1, variant->height / 2);
+    gint mip_start, mip_end;  // rows of the first mip level within the band
+
+    // Build the first mip level while the band is still in cache, bands
+    // start at even rows
+    if (variant->mip_data)
+    {
+        mip_start = variant->band_y / 2;
+        mip_end   = MIN(mip_height, (variant->band_y + variant->band_rows + 1) / 2);
+        if (mip_start < mip_end)
+            plt_downsample(variant->plt_data, variant->width, variant->band_rows,
+                           variant->mip_data + 2*(gsize) mip_width*mip_start,
+                           mip_width, mip_end - mip_start);
+    }
+    // Adjust coordinates
+    flip_plt(variant->plt_data, variant->width, variant->band_rows);
+    // Write image data
+    if (variant->frame_data)
+        memcpy(variant->frame_data + 2*(gsize) variant->width*(variant->height - variant->band_y - variant->band_rows),
+               variant->plt_data, band_size);
+    else if (!plt_writer_write(&variant->writer,
+                               variant->header, variant->header_size,
+                               variant->plt_data, band_size))
+        variant->error = TRUE;
+    // The header goes with the first band
+    variant->header_size = 0;
+
+    g_mutex_lock(&band_writer->mutex);
+    band_writer->pending--;
+    g_cond_signal(&band_writer->done);
+    g_mutex_unlock(&band_writer->mutex);
+}
+
+
+static void wait_for_bands(PltBandWriter *band_writer)
+{
+    g_mutex_lock(&band_writer->mutex);
+    while (band_writer->pending > 0)
+        g_cond_wait(&band_writer->done, &band_writer->mutex);
+    g_mutex_unlock(&band_writer->mutex);
+}
+
+
+static GimpPDBStatusType plt_write_variants(gint32 image_id,
+                                            PltSource *sources,
+                                            gint num_sources,
+                                            PltVariant *variants,
+                                            gint num_variants)
+{
+    unsigned int l, v;
+    guint64 j;
+
+    uint32_t plt_width  = gimp_image_width(image_id);
+    uint32_t plt_height = gimp_image_height(image_id);
+    guint64  plt_row_size;
+    uint8_t *plt_data;
+    guint64  reserved;  // memory kept for the whole save
+
+    uint8_t *layer_data;
+    gint max_bpp;
+    PltSource *source;
+    GimpPDBStatusType status = GIMP_PDB_SUCCESS;
+
+    gint band_height, band_rows, band_y, num_bands, band;
+    gint band_index;  // buffer of the band being composited
+    gint rows_start, rows_end;  // rows of a layer within the current band
+    gint band_row;
+    gint tile_width, tile_height;
+    gint tiles_x0, tiles_x1, tiles_y0, tiles_y1;  // tiles covering these rows
+    gsize layer_row_size, layer_start;
+    PltBandWriter band_writer;
+    GPtrArray *dirs;  // directories of the files written
+
+    // Write to file, delta plts are collected and written at the end
+    for (v = 0; v < num_variants; v++)
+    {
+        if ((variants[v].base_filename == NULL) &&
+            !plt_writer_open(&variants[v].writer, variants[v].filename,
+                             PLT_HEADER_SIZE + 2*(guint64) plt_width*plt_height))
+        {
+            while (v-- > 0)
+            {
+                if (variants[v].base_filename == NULL)
+                    plt_writer_close(&variants[v].writer, FALSE, NULL);
+                g_free(variants[v].frame_data);
+                g_free(variants[v].mip_data);
+            }
+            return (GIMP_PDB_EXECUTION_ERROR);
+        }
+        // Header is written with the first band
+        plt_make_header(variants[v].header, PLT_HEADER_VERSION, plt_width, plt_height);
+        variants[v].header_size = PLT_HEADER_SIZE;
+        variants[v].width = plt_width;
+        variants[v].height = plt_height;
+        variants[v].error = FALSE;
+        variants[v].frame_data = NULL;
+        if (variants[v].base_filename)
+            variants[v].frame_data = (uint8_t*) g_malloc(sizeof(uint8_t)*2*(gsize) plt_width*plt_height);
+        variants[v].mip_data = NULL;
+        if (variants[v].mipmaps)
+            variants[v].mip_data = (uint8_t*) g_malloc(sizeof(uint8_t)*2*(gsize) MAX(1, plt_width/2)*MAX(1, plt_height/2));
+    }
+
+    // Generate image data a band of rows at a time (see plt_load), starting
+    // at the bottom, so the bands can be written as soon as they are done.
+    // Every layer is read once per band and composited into all variants
+    // using it. A band is written in the background while the next one is
+    // composited, so each variant needs two band buffers.
+    max_bpp = 1;
+    for (l = 0; l < num_sources; l++)
+        max_bpp = MAX(max_bpp, sources[l].bpp);
+    // The first mip level and the frames of delta plts are kept until the
+    // end, the smaller levels are built after the bands are freed
+    reserved = 0;
+    for (v = 0; v < num_variants; v++)
+    {
+        if (variants[v].mip_data)
+            reserved += 2 * (guint64) MAX(1, plt_width/2) * MAX(1, plt_height/2);
+        if (variants[v].frame_data)
+            reserved += 2 * (guint64) plt_width * plt_height;
+    }
+    plt_row_size = 2 * (guint64) plt_width;
+    band_height  = get_band_height(2*num_variants*plt_row_size + (guint64) max_bpp*plt_width,
+                                   reserved, plt_height);
+    // Mip levels are built from pairs of rows
+    if (band_height < plt_height)
+        band_height = MAX(2, band_height & ~1);
+    num_bands    = (plt_height + band_height - 1) / band_height;
+    for (v = 0; v < num_variants; v++)
+    {
+        variants[v].bands[0] = (uint8_t*) g_malloc(sizeof(uint8_t)*plt_row_size*band_height);
+        variants[v].bands[1] = (num_bands > 1) ?
+                               (uint8_t*) g_malloc(sizeof(uint8_t)*plt_row_size*band_height) : NULL;
+    }
+    // Layers are read in whole tiles, which may reach up to a tile beyond
+    // the band on each side
+    tile_width  = gimp_tile_width();
+    tile_height = gimp_tile_height();
+    set_tile_cache(plt_width + 2*tile_width);
+    layer_data = (uint8_t*) g_malloc(sizeof(uint8_t)*max_bpp*
+                                     ((gsize) plt_width + 2*tile_width)*
+                                     (band_height + 2*tile_height));
+    // One thread per variant, they only write files and never call gimp
+    band_writer.pool = g_thread_pool_new(write_variant_band, &band_writer,
+                                         num_variants, FALSE, NULL);
+    g_mutex_init(&band_writer.mutex);
+    g_cond_init(&band_writer.done);
+    band_writer.pending = 0;
     gimp_progress_init_printf("Processing layers...");
     gimp_progress_update(0.0);
-    switch(img_basetype)
+    band_index = 0;
+    for (band = num_bands; band-- > 0; )
     {
-        case GIMP_GRAY:
+        band_y    = band * band_height;
+        band_rows = MIN(band_height, (gint) plt_height - band_y);
+        // Init image data
+        for (v = 0; v < num_variants; v++)
         {
-            // Same buffer for images with or without alpha to avoid having to
-            // allocate in loop
-            layer_data = (uint8_t*) g_malloc(sizeof(uint8_t)*2*plt_num_px);
-            
-            for (l = 0; l < PLT_NUM_LAYERS; l++)
+            plt_data = variants[v].bands[band_index];
+            for (j = 0; j < plt_row_size*band_rows; j+=2)
             {
-                plt_id   = plt_layer_ids[l];  
-                layer_id = plt_layer_ids[l+PLT_NUM_LAYERS];                                
-                
-                if ((layer_id >= 0) && get_layer_bounds(image_id, layer_id, &region_x, &region_y, &region_w, &region_h))
-                {
-                    drawable = gimp_drawable_get(layer_id);
-                    bpp = gimp_drawable_bpp(layer_id);
-                
-                    gimp_pixel_rgn_init(&region, drawable,
-                                        region_x, region_y,
-                                        region_w, region_h,
-                                        FALSE, FALSE);
-                    gimp_pixel_rgn_get_rect(&region,
-                                            (uint8_t*) layer_data,
-                                            region_x, region_y,
-                                            region_w, region_h);
-                    
-                    k = 0;
-                    gimp_drawable_offsets(layer_id, &layer_x, &layer_y);
-                    // layer bounds are already adjusted to adress layers being out of bounds
-                    // we still need to adjust plt pixel index 
-                    layer_x = (layer_x > 0) ? layer_x : 0;
-                    layer_y = (layer_y > 0) ? layer_y : 0;
-                    if (gimp_drawable_has_alpha(layer_id))
-                    {
-                        for (i = 0; i < region_h; i++)
-                        {
-                            for (j = 0; j < region_w; j++)
-                            {                                
-                                if (layer_data[k+1] > PLT_ALPHA_THRESHOLD)
-                                {
-                                    plt_data[2*((i+layer_y)*plt_width+j+layer_x)] = layer_data[k];
-                                    plt_data[2*((i+layer_y)*plt_width+j+layer_x)+1] = plt_id;
-                                }
-                                k+=bpp;
-                            }                            
-                        }
-                    }
-                    else
-                    {
-                        // No alpha value means bottom layers are not visible
-                        // i.e. always overwrite everything
-                        for (i = 0; i < region_h; i++)
-                        {
-                            for (j = 0; j < region_w; j++)
-                            {
-                                plt_data[2*((i+layer_y)*plt_width+j+layer_x)] = layer_data[k];
-                                plt_data[2*((i+layer_y)*plt_width+j+layer_x)+1] = plt_id;
-                                k += bpp;
-                            }                            
-                        }
-                    }
-                }
-                gimp_progress_update((float) i/(float) detected_layers);
+                plt_data[j] = 255;
+                plt_data[j+1] = 0;
             }
-            break;
         }
-        case GIMP_RGB:
+        for (l = 0; l < num_sources; l++)
         {
-            // Same buffer for images with or without alpha to avoid having to
-            // allocate in loop
-            layer_data = (uint8_t*) g_malloc(sizeof(uint8_t)*plt_num_px*4);
-                                
-            for (l = 0; l < PLT_NUM_LAYERS; l++)
+            source = &sources[l];
+            rows_start = MAX(source->y, band_y);
+            rows_end   = MIN(source->y + source->height, band_y + band_rows);
+            if (rows_start < rows_end)
             {
-                plt_id   = plt_layer_ids[l];  
-                layer_id = plt_layer_ids[l+PLT_NUM_LAYERS];                                
-                
-                if ((layer_id >= 0) && get_layer_bounds(image_id, layer_id, &region_x, &region_y, &region_w, &region_h))
+                // Same rows in layer coordinates, extended to the layer's
+                // tile grid
+                band_row    = rows_start - band_y;
+                rows_start += source->ly - source->y;
+                rows_end   += source->ly - source->y;
+                align_to_tiles(source->lx, source->lx + source->width,
+                               tile_width, source->drawable->width,
+                               &tiles_x0, &tiles_x1);
+                align_to_tiles(rows_start, rows_end,
+                               tile_height, source->drawable->height,
+                               &tiles_y0, &tiles_y1);
+                gimp_pixel_rgn_get_rect(&source->region,
+                                        (uint8_t*) layer_data,
+                                        tiles_x0, tiles_y0,
+                                        tiles_x1 - tiles_x0, tiles_y1 - tiles_y0);
+                layer_row_size = (gsize) source->bpp * (tiles_x1 - tiles_x0);
+                layer_start = (rows_start - tiles_y0)*layer_row_size +
+                              (source->lx - tiles_x0)*source->bpp;
+                for (v = 0; v < num_variants; v++)
                 {
-                    drawable = gimp_drawable_get(layer_id);
-                    bpp = gimp_drawable_bpp(layer_id);
-                
-                    gimp_pixel_rgn_init(&region, drawable,
-                                        region_x, region_y,
-                                        region_w, region_h,
-                                        FALSE, FALSE);
-                    gimp_pixel_rgn_get_rect(&region,
-                                            (uint8_t*) layer_data,
-                                            0, 0,
-                                            region_w, region_h);
-                    k = 0;
-                    gimp_drawable_offsets(layer_id, &layer_x, &layer_y);
-                    // layer bounds are already adjusted to adress layers being out of bounds
-                    // we still need to adjust plt pixel index 
-                    layer_x = (layer_x > 0) ? layer_x : 0;
-                    layer_y = (layer_y > 0) ? layer_y : 0;
-                    if (gimp_drawable_has_alpha(layer_id))
-                    {
-                        for (i = 0; i < region_h; i++)
-                        {
-                            for (j = 0; j < region_w; j++)
-                            {                                
-                                if (layer_data[k+3] > PLT_ALPHA_THRESHOLD)
-                                {
-                                    plt_data[2*((i+layer_y)*plt_width+j+layer_x)] = (layer_data[k] + layer_data[k+1] + layer_data[k+2])/3;
-                                    plt_data[2*((i+layer_y)*plt_width+j+layer_x)+1] = plt_id;
-                                }
-                                k+=bpp;
-                            }                            
-                        }
-                    }
-                    else
-                    {
-                        // No alpha value means bottom layers are not visible
-                        // i.e. always overwrite everything
-                        for (i = 0; i < region_h; i++)
-                        {
-                            for (j = 0; j < region_w; j++)
-                            {
-                                plt_data[2*((i+layer_y)*plt_width+j+layer_x)]= (layer_data[k] + layer_data[k+1] + layer_data[k+2])/3;
-                                plt_data[2*((i+layer_y)*plt_width+j+layer_x)+1] = plt_id;
-                                k += bpp;
-                            }                            
-                        }
-                    }
+                    if (source->variants & (1u << v))
+                        source->composite(variants[v].bands[band_index] + band_row*plt_row_size + 2*source->x,
+                                          plt_row_size,
+                                          layer_data + layer_start, layer_row_size,
+                                          source->width, rows_end - rows_start,
+                                          source->plt_id);
                 }
-                gimp_progress_update((float) i/(float) detected_layers);
             }
-            break;
         }
+        // The previous band has to be written before this one, then the
+        // variants write this band while the next one is composited
+        wait_for_bands(&band_writer);
+        band_writer.pending = num_variants;
+        for (v = 0; v < num_variants; v++)
+        {
+            variants[v].plt_data  = variants[v].bands[band_index];
+            variants[v].band_y    = band_y;
+            variants[v].band_rows = band_rows;
+            g_thread_pool_push(band_writer.pool, &variants[v], NULL);
+        }
+        band_index = 1 - band_index;
+        gimp_progress_update((float) (num_bands - band)/(float) num_bands);
     }
-    gimp_progress_update(1.0);
+    wait_for_bands(&band_writer);
+    g_thread_pool_free(band_writer.pool, FALSE, TRUE);
+    g_cond_clear(&band_writer.done);
+    g_mutex_clear(&band_writer.mutex);
     g_free(layer_data);
-    g_free(plt_layer_ids);
+    gimp_progress_update(1.0);
 
-    // Adjust coordinates
-    flip_plt(plt_data, plt_width, plt_height);
+    dirs = g_ptr_array_new_with_free_func(g_free);
+    for (v = 0; v < num_variants; v++)
+    {
+        if ((variants[v].base_filename == NULL) &&
+            !plt_writer_close(&variants[v].writer, !variants[v].error, dirs))
+            status = GIMP_PDB_EXECUTION_ERROR;
+        g_free(variants[v].bands[0]);
+        g_free(variants[v].bands[1]);
+        if (variants[v].frame_data)
+        {
+            if ((status == GIMP_PDB_SUCCESS) && !plt_write_delta(&variants[v], dirs))
+                status = GIMP_PDB_EXECUTION_ERROR;
+            g_free(variants[v].frame_data);
+        }
+        if (variants[v].mip_data)
+        {
+            if ((status == GIMP_PDB_SUCCESS) && !plt_write_mipmaps(&variants[v], dirs))
+                status = GIMP_PDB_EXECUTION_ERROR;
+            g_free(variants[v].mip_data);
+        }
+    }
+    plt_sync_dirs(dirs);
+
+    return (status);
+}
 
-    // Write to file
-    stream = fopen(filename, "wb");
+
+static gchar *get_base_filename(const gchar *filename, const gchar *base_filename)
+{
+    gchar *dirname;
+    gchar *result;
+
+    // Relative base paths are relative to the delta plt
+    if (g_path_is_absolute(base_filename))
+        return (g_strdup(base_filename));
+    dirname = g_path_get_dirname(filename);
+    result = g_build_filename(dirname, base_filename, NULL);
+    g_free(dirname);
+    return (result);
+}
+
+
+static FILE *plt_open_base(const gchar *filename,
+                           const uint32_t width, const uint32_t height)
+{
+    FILE *stream = 0;
+    uint8_t  plt_version[8];
+    uint32_t plt_size[2];
+
+    stream = fopen(filename, "rb");
     if (stream == 0)
     {
-        g_message("Error opening %s\n", filename);
+        g_message("Error opening base %s\n", filename);
+        return (NULL);
+    }
+    // Read header, the base has to be a regular plt of the same size
+    if ((fread(plt_version, 1, 8, stream) < 8) ||
+        (g_ascii_strncasecmp(plt_version, PLT_HEADER_VERSION, 8) != 0) ||
+        (fseek(stream, 8, SEEK_CUR) != 0) ||
+        (fread(plt_size, 4, 2, stream) < 2) ||
+        (plt_size[0] != width) || (plt_size[1] != height))
+    {
+        g_message("Invalid base %s: Not a plt of size %ux%u.\n", filename, width, height);
+        fclose(stream);
+        return (NULL);
+    }
+    return (stream);
+}
+
+
+static uint8_t *plt_load_base(const gchar *filename,
+                              const uint32_t width, const uint32_t height)
+{
+    FILE *stream = 0;
+    const gsize plt_data_size = 2 * (gsize) width * height;
+    uint8_t *plt_data;
+
+    // Bases shared by several deltas are read from the page cache after
+    // the first load
+    stream = plt_open_base(filename, width, height);
+    if (stream == 0)
+        return (NULL);
+    plt_data = (uint8_t*) g_malloc(sizeof(uint8_t)*plt_data_size);
+    if (fread(plt_data, 1, plt_data_size, stream) < plt_data_size)
+    {
+        g_message("Invalid base %s: Image size mismatch.\n", filename);
+        fclose(stream);
         g_free(plt_data);
-        return (GIMP_PDB_EXECUTION_ERROR);
+        return (NULL);
     }
-    // Write header
-    fwrite(plt_version, 1, 8, stream);
-    fwrite(plt_info, 1, 8, stream);
-    fwrite(&plt_width, 4, 1, stream);
-    fwrite(&plt_height, 4, 1, stream);
-    // Write image data
-    fwrite(plt_data, 1, 2*plt_num_px, stream);
     fclose(stream);
+    return (plt_data);
+}
 
-    g_free(plt_data);
 
-    return (GIMP_PDB_SUCCESS);
+static uint8_t *plt_read_delta(FILE *stream, const gchar *filename,
+                               const uint32_t width, const uint32_t height)
+{
+    unsigned int i, r;
+    uint32_t tile_size;
+    uint32_t tiles_x, tiles_y;
+    uint32_t num_tiles;
+    uint32_t *tile_ids;
+    uint32_t tile_x, tile_y, tile_w, tile_h;
+    uint32_t base_length;
+    gchar *base_filename;
+    gchar *base_path;
+    uint8_t *plt_data;
+    gboolean valid;
+
+    // Read header: Tile size and base plt
+    if ((fread(&tile_size, 4, 1, stream) < 1) || (tile_size == 0) ||
+        (fread(&base_length, 4, 1, stream) < 1) || (base_length == 0) ||
+        (base_length > PLT_DELTA_MAX_PATH))
+    {
+        g_message("Invalid delta plt file: Unable to read base.\n");
+        return (NULL);
+    }
+    base_filename = (gchar*) g_malloc(base_length + 1);
+    if (fread(base_filename, 1, base_length, stream) < base_length)
+    {
+        g_message("Invalid delta plt file: Unable to read base.\n");
+        g_free(base_filename);
+        return (NULL);
+    }
+    base_filename[base_length] = '\0';
+
+    // Read header: Changed tiles, indexed row by row
+    tiles_x = (width  + tile_size - 1) / tile_size;
+    tiles_y = (height + tile_size - 1) / tile_size;
+    if ((fread(&num_tiles, 4, 1, stream) < 1) ||
+        ((guint64) num_tiles > (guint64) tiles_x * tiles_y))
+    {
+        g_message("Invalid delta plt file: Unable to read tiles.\n");
+        g_free(base_filename);
+        return (NULL);
+    }
+    tile_ids = (uint32_t*) g_malloc(sizeof(uint32_t)*MAX(1, num_tiles));
+    valid = (fread(tile_ids, 4, num_tiles, stream) == num_tiles);
+    for (i = 0; valid && (i < num_tiles); i++)
+        valid = ((guint64) tile_ids[i] < (guint64) tiles_x * tiles_y);
+    if (!valid)
+    {
+        g_message("Invalid delta plt file: Unable to read tiles.\n");
+        g_free(tile_ids);
+        g_free(base_filename);
+        return (NULL);
+    }
+
+    base_path = get_base_filename(filename, base_filename);
+    plt_data = plt_load_base(base_path, width, height);
+    g_free(base_path);
+    g_free(base_filename);
+    if (plt_data == NULL)
+    {
+        g_free(tile_ids);
+        return (NULL);
+    }
+
+    // Replace the changed tiles, clipped to the image
+    for (i = 0; valid && (i < num_tiles); i++)
+    {
+        tile_x = (tile_ids[i] % tiles_x) * tile_size;
+        tile_y = (tile_ids[i] / tiles_x) * tile_size;
+        tile_w = MIN(tile_size, width - tile_x);
+        tile_h = MIN(tile_size, height - tile_y);
+        for (r = 0; valid && (r < tile_h); r++)
+            valid = (fread(plt_data + 2*((gsize) (tile_y + r)*width + tile_x),
+                           1, 2*tile_w, stream) == 2*tile_w);
+    }
+    g_free(tile_ids);
+    if (!valid)
+    {
+        g_message("Image size mismatch.\n");
+        g_free(plt_data);
+        return (NULL);
+    }
+    return (plt_data);
+}
+
+
+static gboolean plt_write_delta(const PltVariant *variant, GPtrArray *dirs)
+{
+    PltWriter writer;
+    PltChunk chunks[PLT_DELTA_TILE_SIZE];
+    unsigned int i, r;
+    const uint32_t width  = variant->width;
+    const uint32_t height = variant->height;
+    const gsize row_size = 2 * (gsize) width;
+    const uint32_t tile_size = PLT_DELTA_TILE_SIZE;
+    const uint32_t tiles_x = (width  + tile_size - 1) / tile_size;
+    const uint32_t tiles_y = (height + tile_size - 1) / tile_size;
+    const uint32_t base_length = strlen(variant->base_filename);
+    uint32_t num_tiles;
+    uint32_t *tile_ids;
+    uint32_t tile_x, tile_y, tile_w, tile_h;
+    gchar *base_path;
+    FILE *base_stream;
+    uint8_t *base_rows;  // a row of tiles of the base
+    uint8_t *header;
+    gsize header_size;
+    gsize tile_data_size;
+    gsize offset;
+    gboolean result = TRUE;
+
+    if ((base_length == 0) || (base_length > PLT_DELTA_MAX_PATH))
+    {
+        g_message("Invalid base filename %s\n", variant->base_filename);
+        return FALSE;
+    }
+    base_path = get_base_filename(variant->filename, variant->base_filename);
+    base_stream = plt_open_base(base_path, width, height);
+    if (base_stream == 0)
+    {
+        g_free(base_path);
+        return FALSE;
+    }
+
+    // Keep the tiles which differ from the base. Both are in file order,
+    // so the base is read sequentially, a row of tiles at a time.
+    tile_ids = (uint32_t*) g_malloc(sizeof(uint32_t)*tiles_x*tiles_y);
+    base_rows = (uint8_t*) g_malloc(sizeof(uint8_t)*row_size*tile_size);
+    num_tiles = 0;
+    tile_data_size = 0;
+    for (i = 0; result && (i < tiles_x*tiles_y); i++)
+    {
+        tile_x = (i % tiles_x) * tile_size;
+        tile_y = (i / tiles_x) * tile_size;
+        tile_w = MIN(tile_size, width - tile_x);
+        tile_h = MIN(tile_size, height - tile_y);
+        if ((tile_x == 0) &&
+            (fread(base_rows, 1, row_size*tile_h, base_stream) < row_size*tile_h))
+        {
+            g_message("Invalid base %s: Image size mismatch.\n", base_path);
+            result = FALSE;
+            break;
+        }
+        for (r = 0; r < tile_h; r++)
+        {
+            offset = r*row_size + 2*tile_x;
+            if (memcmp(variant->frame_data + tile_y*row_size + offset, base_rows + offset, 2*tile_w))
+            {
+                tile_ids[num_tiles++] = i;
+                tile_data_size += 2 * (gsize) tile_w * tile_h;
+                break;
+            }
+        }
+    }
+    fclose(base_stream);
+    g_free(base_rows);
+    g_free(base_path);
+    if (!result)
+    {
+        g_free(tile_ids);
+        return FALSE;
+    }
+
+    // Nearly everything changed, a regular plt is smaller
+    header_size = PLT_HEADER_SIZE + 12 + base_length + 4*(gsize) num_tiles;
+    if (header_size + tile_data_size >= PLT_HEADER_SIZE + row_size*height)
+    {
+        g_free(tile_ids);
+        header = (uint8_t*) g_malloc(PLT_HEADER_SIZE);
+        plt_make_header(header, PLT_HEADER_VERSION, width, height);
+        result = plt_writer_open(&writer, variant->filename, PLT_HEADER_SIZE + row_size*height);
+        if (result)
+        {
+            result = plt_writer_write(&writer, header, PLT_HEADER_SIZE,
+                                      variant->frame_data, row_size*height);
+            result = plt_writer_close(&writer, result, dirs);
+        }
+        g_free(header);
+        return (result);
+    }
+
+    // Header
+    header = (uint8_t*) g_malloc(header_size);
+    plt_make_header(header, PLT_DELTA_VERSION, width, height);
+    offset = PLT_HEADER_SIZE;
+    memcpy(header + offset, &tile_size, 4);
+    memcpy(header + offset + 4, &base_length, 4);
+    memcpy(header + offset + 8, variant->base_filename, base_length);
+    offset += 8 + base_length;
+    memcpy(header + offset, &num_tiles, 4);
+    memcpy(header + offset + 4, tile_ids, 4*(gsize) num_tiles);
+
+    // Changed tiles, written straight from the frame a tile at a time
+    result = plt_writer_open(&writer, variant->filename, header_size + tile_data_size);
+    if (result)
+    {
+        result = plt_writer_write(&writer, header, header_size, NULL, 0);
+        for (i = 0; result && (i < num_tiles); i++)
+        {
+            tile_x = (tile_ids[i] % tiles_x) * tile_size;
+            tile_y = (tile_ids[i] / tiles_x) * tile_size;
+            tile_w = MIN(tile_size, width - tile_x);
+            tile_h = MIN(tile_size, height - tile_y);
+            for (r = 0; r < tile_h; r++)
+            {
+                chunks[r].data = variant->frame_data + (tile_y + r)*row_size + 2*tile_x;
+                chunks[r].size = 2 * (gsize) tile_w;
+            }
+            result = plt_writer_writev(&writer, chunks, tile_h);
+        }
+        result = plt_writer_close(&writer, result, dirs);
+    }
+    g_free(tile_ids);
+    g_free(header);
+    return (result);
+}
+
+
+static void add_variant_sources(gint32 image_id, gint32 item_id,
+                                guint32 variants, GArray *sources)
+{
+    unsigned int i;
+    gint num_children;
+    gint *child_ids;
+    gchar *layer_name;
+    PltSource source;
+
+    if (gimp_item_is_group(item_id))
+    {
+        // Top child first, same as plt_save
+        child_ids = gimp_item_get_children(item_id, &num_children);
+        for (i = 0; i < num_children; i++)
+            add_variant_sources(image_id, child_ids[i], variants, sources);
+        g_free(child_ids);
+        return;
+    }
+    layer_name = gimp_item_get_name(item_id);
+    for (i = 0; i < PLT_NUM_LAYERS; i++)
+    {
+        if (!g_ascii_strcasecmp(PLT_LAYERS[i], layer_name))
+        {
+            if (init_source(&source, image_id, item_id, i, variants))
+                g_array_append_val(sources, source);
+            break;
+        }
+    }
+    g_free(layer_name);
+}
+
+
+static GimpPDBStatusType plt_save_variants(gchar *filename, gint32 image_id)
+{
+    unsigned int l, v;
+
+    gint img_num_layers; // num layers in image
+    gint *img_layer_ids; // all layers in image
+    GArray *sources;     // plt layers with pixels inside the image
+    PltVariant variants[PLT_MAX_VARIANTS];
+    gint num_variants;
+    guint32 all_variants;
+    gchar *image_filename;
+    gchar *basename;
+    gchar *variant_name;
+    GimpPDBStatusType status;
+
+    if (!check_image(image_id))
+        return (GIMP_PDB_EXECUTION_ERROR);
+
+    // Without a filename the variants are saved next to the image
+    if ((filename != NULL) && (filename[0] != '\0'))
+        image_filename = g_strdup(filename);
+    else
+        image_filename = gimp_image_get_filename(image_id);
+    if (image_filename == NULL)
+    {
+        g_message("No filename for variants.\n");
+        return (GIMP_PDB_EXECUTION_ERROR);
+    }
+    basename = strip_extension(image_filename);
+    g_free(image_filename);
+
+    // Every top level layer group is a variant. Plt layers inside a group
+    // belong to this variant only, top level plt layers are shared by all.
+    img_layer_ids = gimp_image_get_layers(image_id, &img_num_layers);
+    num_variants = 0;
+    for (l = 0; l < img_num_layers; l++)
+    {
+        if (gimp_item_is_group(img_layer_ids[l]))
+        {
+            if (num_variants >= PLT_MAX_VARIANTS)
+            {
+                g_message("Too many variants, at most %d are supported.\n", PLT_MAX_VARIANTS);
+                for (v = 0; v < num_variants; v++)
+                    g_free(variants[v].filename);
+                g_free(img_layer_ids);
+                g_free(basename);
+                return (GIMP_PDB_EXECUTION_ERROR);
+            }
+            variant_name = gimp_item_get_name(img_layer_ids[l]);
+            g_strdelimit(variant_name, "/\\", '_');
+            variants[num_variants].filename = g_strdup_printf("%s-%s.plt", basename, variant_name);
+            variants[num_variants].mipmaps = FALSE;
+            variants[num_variants].base_filename = NULL;
+            g_free(variant_name);
+            num_variants++;
+        }
+    }
+    g_free(basename);
+    if (num_variants == 0)
+    {
+        g_message("No variants found, put each variant into a layer group.\n");
+        g_free(img_layer_ids);
+        return (GIMP_PDB_EXECUTION_ERROR);
+    }
+
+    all_variants = (num_variants < 32) ? ((1u << num_variants) - 1) : 0xFFFFFFFFu;
+    sources = g_array_new(FALSE, FALSE, sizeof(PltSource));
+    v = 0;
+    for (l = 0; l < img_num_layers; l++)
+    {
+        if (gimp_item_is_group(img_layer_ids[l]))
+            add_variant_sources(image_id, img_layer_ids[l], 1u << v++, sources);
+        else
+            add_variant_sources(image_id, img_layer_ids[l], all_variants, sources);
+    }
+    g_free(img_layer_ids);
+
+    status = plt_write_variants(image_id,
+                                (PltSource*) sources->data, sources->len,
+                                variants, num_variants);
+
+    for (l = 0; l < sources->len; l++)
+        gimp_drawable_detach(g_array_index(sources, PltSource, l).drawable);
+    g_array_free(sources, TRUE);
+    for (v = 0; v < num_variants; v++)
+        g_free(variants[v].filename);
+
+    return (status);
 }
 
 
@@ -24,11 +24,36 @@
 
 #define LOAD_PROCEDURE "file-bioplt-load"
 #define SAVE_PROCEDURE "file-bioplt-save"
+#define SAVE2_PROCEDURE "file-bioplt-save2"
 #define ADDL_PROCEDURE "file-bioplt-addl"
+#define VARIANTS_PROCEDURE "file-bioplt-save-variants"
 
 #define PLT_HEADER_VERSION "PLT V1  "
+#define PLT_DELTA_VERSION  "PLT D1  "
 #define PLT_NUM_LAYERS 10
 #define PLT_ALPHA_THRESHOLD 25
+#define PLT_HEADER_SIZE 24
+#define PLT_MAX_VARIANTS 32
+
+// Delta plts store only the tiles differing from a base plt. After the
+// regular header follow the tile size, the length and path of the base,
+// the number of changed tiles, their indices (row by row) and their data.
+#define PLT_DELTA_TILE_SIZE 64
+#define PLT_DELTA_MAX_PATH 4096
+
+// Symlinks followed to find the file to replace
+#define PLT_MAX_SYMLINKS 32
+
+// Chunks written with a single writev, well below IOV_MAX
+#define PLT_WRITE_CHUNKS 64
+
+// Maximum size in bytes of the pixel buffers used by load and save, larger
+// images are processed in bands of rows. Buffers kept for the whole image,
+// like the first mip level, are taken from the budget before the bands.
+// Bands are at least a row of tiles, even if that exceeds the budget.
+// Loading a delta plt needs the whole image in memory. Can be overridden
+// by setting the PLT_MEMORY_BUDGET environment variable.
+#define PLT_MEMORY_BUDGET (256*1024*1024)
 
 // New layers can easily be added by extending this list, they
 // will automatically be included
@@ -53,9 +78,148 @@ static void run(const gchar      *name,
                 gint             *nreturn_vals,
                 GimpParam       **return_vals);
 
+// Save options, kept between runs
+typedef struct
+{
+    gint mipmaps;
+} PltSaveVals;
+
+// Composites a block of layer pixels into plt data
+typedef void (*PltCompositeFunc)(uint8_t *plt_data, const guint64 plt_row_size,
+                                 const uint8_t *layer_data, const gsize layer_row_size,
+                                 const gint width, const gint height,
+                                 const uint8_t plt_id);
+
+// A gimp layer used as a plt layer, only the part within the image
+typedef struct
+{
+    gint32           layer_id;
+    gint             plt_id;
+    guint32          variants;    // bit mask of the variants using it
+    GimpDrawable    *drawable;
+    GimpPixelRgn     region;
+    gint             bpp;
+    PltCompositeFunc composite;   // kernel for the layer type
+    gint             x, y;        // position in the image
+    gint             lx, ly;      // position in the layer
+    gint             width, height;
+} PltSource;
+
+// Piece of data written by plt_writer_writev
+typedef struct
+{
+    const uint8_t *data;
+    gsize          size;
+} PltChunk;
+
+// Output file, written to a temporary file which replaces the target
+// when it is complete
+typedef struct
+{
+    gchar    *filename;
+    gchar    *temp_filename;
+    gint      fd;
+#ifndef G_OS_UNIX
+    FILE     *stream;
+#endif
+    gboolean  error;
+    gint      error_code;  // errno of the first failure
+} PltWriter;
+
+// An output file, the band of plt data currently being written
+typedef struct
+{
+    gchar    *filename;
+    PltWriter writer;
+    uint8_t   header[PLT_HEADER_SIZE];
+    gsize     header_size;  // header still to be written
+    uint8_t  *bands[2];     // one is composited while the other is written
+    uint8_t  *plt_data;     // band being written
+    uint32_t  width, height;
+    gint      band_y, band_rows;
+    gboolean  error;
+    gboolean  mipmaps;
+    uint8_t  *mip_data;    // first mip level, built band by band
+    gchar    *base_filename;
+    uint8_t  *frame_data;  // all plt data, only needed for deltas
+} PltVariant;
+
+// Writes the bands of all variants in the background
+typedef struct
+{
+    GThreadPool *pool;
+    GMutex       mutex;
+    GCond        done;
+    gint         pending;  // bands still being written
+} PltBandWriter;
+
 static GimpPDBStatusType plt_load(gchar *filename, gint32 *image_id);
 
-static GimpPDBStatusType plt_save(gchar *filename, gint32 image_id);
+static GimpPDBStatusType plt_save(gchar *filename, gint32 image_id,
+                                  gboolean mipmaps, gchar *base_filename);
+
+static GimpPDBStatusType plt_save_variants(gchar *filename, gint32 image_id);
+
+static GimpPDBStatusType plt_write_variants(gint32 image_id,
+                                            PltSource *sources,
+                                            gint num_sources,
+                                            PltVariant *variants,
+                                            gint num_variants);
+
+static void write_variant_band(gpointer data, gpointer user_data);
+
+static void wait_for_bands(PltBandWriter *band_writer);
+
+static void plt_make_header(uint8_t *header, const gchar *version,
+                            const uint32_t width, const uint32_t height);
+
+static gchar *resolve_symlinks(const gchar *filename);
+
+static void plt_writer_fail(PltWriter *writer, const gint error_code);
+
+static gboolean plt_writer_open(PltWriter *writer, const gchar *filename,
+                                const guint64 size);
+
+static gboolean plt_writer_writev(PltWriter *writer,
+                                  const PltChunk *chunks, const gint num_chunks);
+
+static gboolean plt_writer_write(PltWriter *writer,
+                                 const uint8_t *header, const gsize header_size,
+                                 const uint8_t *data, const gsize data_size);
+
+static gboolean plt_writer_close(PltWriter *writer, const gboolean commit,
+                                 GPtrArray *dirs);
+
+static void plt_sync_dirs(GPtrArray *dirs);
+
+static inline void plt_downsample_block(const uint8_t *p0, const uint8_t *p1,
+                                        const uint8_t *p2, const uint8_t *p3,
+                                        uint8_t *dst);
+
+static void plt_downsample(const uint8_t *src, const uint32_t src_width, const gint src_height,
+                           uint8_t *dst, const uint32_t dst_width, const gint dst_height);
+
+static gboolean plt_write_file(const gchar *filename, uint8_t *plt_data,
+                               const uint32_t width, const uint32_t height,
+                               GPtrArray *dirs);
+
+static gboolean plt_write_mipmaps(const PltVariant *variant, GPtrArray *dirs);
+
+static gchar *get_base_filename(const gchar *filename, const gchar *base_filename);
+
+static FILE *plt_open_base(const gchar *filename,
+                           const uint32_t width, const uint32_t height);
+
+static uint8_t *plt_load_base(const gchar *filename,
+                              const uint32_t width, const uint32_t height);
+
+static uint8_t *plt_read_delta(FILE *stream, const gchar *filename,
+                               const uint32_t width, const uint32_t height);
+
+static gboolean plt_write_delta(const PltVariant *variant, GPtrArray *dirs);
+
+static void add_variant_sources(gint32 image_id, gint32 item_id,
+                                guint32 variants, GArray *sources);
 
 static GimpPDBStatusType plt_add_layers(gint32 image_id);
 
@@ -63,7 +227,25 @@ static void flip_plt(uint8_t *pixels,
                      const uint32_t width,
                      const uint32_t height);
 
+static guint64 get_memory_budget(void);
+
+static gint get_band_height(const guint64 row_size, const guint64 reserved,
+                            const gint height);
+
+static void align_to_tiles(const gint start, const gint end,
+                           const gint tile_size, const gint limit,
+                           gint *aligned_start, gint *aligned_end);
+
+static void set_tile_cache(const gint width);
+
+static gboolean check_image(gint32 image_id);
+
+static gchar *strip_extension(const gchar *filename);
+
 static int get_layer_bounds(const gint32 image_id, const gint32 layer_id,
                             gint *bx, gint *by, gint *bw, gint *bh);
 
+static gboolean init_source(PltSource *source, gint32 image_id,
+                            gint32 layer_id, gint plt_id, guint32 variants);
+
 #endif
@@ -0,0 +1,656 @@
+// ##### BEGIN GPL LICENSE BLOCK #####
+//
+//  This program is free software; you can redistribute it and/or
+//  modify it under the terms of the GNU General Public License
+//  as published by the Free Software Foundation; either version 3
+//  of the License, or (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with this program; if not, write to the Free Software Foundation,
+//  Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+//
+// ##### END GPL LICENSE BLOCK #####
+
+#include "libgimp-stub.h"
+
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#define STUB_MAX_ITEMS  4096
+#define STUB_MAX_IMAGES 256
+
+// A layer or layer group, ids are indices into stub_items
+typedef struct
+{
+    gboolean       used;
+    gint32         image_id;
+    gchar         *name;
+    gboolean       is_group;
+    GimpImageType  type;
+    gint           width, height;
+    gint           offset_x, offset_y;
+    guchar        *pixels;
+    GArray        *children;   // groups only, top child first
+    gint32         parent_id;  // 0 for top level, -1 if not inserted
+} StubItem;
+
+typedef struct
+{
+    gboolean           used;
+    gint               width, height;
+    GimpImageBaseType  base_type;
+    gchar             *filename;
+    GArray            *layers;  // top level items, top layer first
+    gboolean           undo_enabled;
+} StubImage;
+
+// Session data set by gimp_set_data
+typedef struct
+{
+    gchar   *identifier;
+    gpointer data;
+    guint32  size;
+} StubData;
+
+StubCounters stub_counters;
+
+static StubItem   stub_items[STUB_MAX_ITEMS];
+static gint32     stub_num_items = 1;   // 0 is not a valid id
+static StubImage  stub_images[STUB_MAX_IMAGES];
+static gint32     stub_num_images = 1;
+static GPtrArray *stub_data = NULL;
+
+
+static gint get_bpp(GimpImageType type)
+{
+    switch (type)
+    {
+        case GIMP_RGB_IMAGE:      return 3;
+        case GIMP_RGBA_IMAGE:     return 4;
+        case GIMP_GRAY_IMAGE:     return 1;
+        case GIMP_GRAYA_IMAGE:    return 2;
+        case GIMP_INDEXED_IMAGE:  return 1;
+        case GIMP_INDEXEDA_IMAGE: return 2;
+    }
+    return 1;
+}
+
+
+static StubItem *get_item(gint32 item_id)
+{
+    if ((item_id <= 0) || (item_id >= stub_num_items) || !stub_items[item_id].used)
+    {
+        fprintf(stderr, "libgimp stub: invalid item %d\n", item_id);
+        abort();
+    }
+    return (&stub_items[item_id]);
+}
+
+
+static StubImage *get_image(gint32 image_id)
+{
+    if (!gimp_image_is_valid(image_id))
+    {
+        fprintf(stderr, "libgimp stub: invalid image %d\n", image_id);
+        abort();
+    }
+    return (&stub_images[image_id]);
+}
+
+
+static gint32 new_item(gint32 image_id, const gchar *name)
+{
+    StubItem *item;
+
+    if (stub_num_items >= STUB_MAX_ITEMS)
+    {
+        fprintf(stderr, "libgimp stub: too many items\n");
+        abort();
+    }
+    item = &stub_items[stub_num_items];
+    memset(item, 0, sizeof(StubItem));
+    item->used      = TRUE;
+    item->image_id  = image_id;
+    item->name      = g_strdup(name);
+    item->parent_id = -1;
+    return (stub_num_items++);
+}
+
+
+// Items contained in the image or a group
+static GArray *get_container(gint32 image_id, gint32 parent_id)
+{
+    if (parent_id > 0)
+        return (get_item(parent_id)->children);
+    return (get_image(image_id)->layers);
+}
+
+
+static void check_rect(StubItem *item, gint x, gint y, gint width, gint height)
+{
+    // Transfers are aligned if they start on a tile and end on a tile or
+    // at the edge of the drawable
+    if ((x % STUB_TILE_SIZE) || (y % STUB_TILE_SIZE) ||
+        (((x + width) % STUB_TILE_SIZE) && (x + width != item->width)) ||
+        (((y + height) % STUB_TILE_SIZE) && (y + height != item->height)))
+        stub_counters.misaligned_rects++;
+}
+
+
+static gboolean valid_rect(StubItem *item, gint x, gint y, gint width, gint height)
+{
+    if ((x < 0) || (y < 0) || (width <= 0) || (height <= 0) ||
+        (x + width > item->width) || (y + height > item->height))
+    {
+        fprintf(stderr, "libgimp stub: rect %d,%d %dx%d outside of %s (%dx%d)\n",
+                x, y, width, height, item->name, item->width, item->height);
+        stub_counters.invalid_rects++;
+        return FALSE;
+    }
+    return TRUE;
+}
+
+
+void stub_reset_counters(void)
+{
+    gint live_drawables = stub_counters.live_drawables;
+
+    memset(&stub_counters, 0, sizeof(StubCounters));
+    stub_counters.live_drawables = live_drawables;
+}
+
+
+guchar *stub_layer_pixels(gint32 layer_id)
+{
+    return (get_item(layer_id)->pixels);
+}
+
+
+void stub_layer_set_offsets(gint32 layer_id, gint offset_x, gint offset_y)
+{
+    StubItem *item = get_item(layer_id);
+
+    item->offset_x = offset_x;
+    item->offset_y = offset_y;
+}
+
+
+gint32 stub_layer_group_new(gint32 image_id, const gchar *name)
+{
+    gint32 group_id = new_item(image_id, name);
+    StubItem *item = get_item(group_id);
+
+    item->is_group = TRUE;
+    item->type     = GIMP_RGBA_IMAGE;
+    item->children = g_array_new(FALSE, FALSE, sizeof(gint32));
+    return (group_id);
+}
+
+
+gboolean stub_image_undo_is_enabled(gint32 image_id)
+{
+    return (get_image(image_id)->undo_enabled);
+}
+
+
+guint gimp_tile_width(void)
+{
+    return STUB_TILE_SIZE;
+}
+
+
+guint gimp_tile_height(void)
+{
+    return STUB_TILE_SIZE;
+}
+
+
+void gimp_tile_cache_ntiles(gulong ntiles)
+{
+}
+
+
+void gimp_install_procedure(const gchar        *name,
+                            const gchar        *blurb,
+                            const gchar        *help,
+                            const gchar        *author,
+                            const gchar        *copyright,
+                            const gchar        *date,
+                            const gchar        *menu_label,
+                            const gchar        *image_types,
+                            GimpPDBProcType     type,
+                            gint                n_params,
+                            gint                n_return_vals,
+                            const GimpParamDef *params,
+                            const GimpParamDef *return_vals)
+{
+}
+
+
+gboolean gimp_plugin_menu_register(const gchar *procedure_name,
+                                   const gchar *menu_path)
+{
+    return TRUE;
+}
+
+
+gboolean gimp_register_file_handler_mime(const gchar *procedure_name,
+                                         const gchar *mime_type)
+{
+    return TRUE;
+}
+
+
+gboolean gimp_register_load_handler(const gchar *procedure_name,
+                                    const gchar *extensions,
+                                    const gchar *prefixes)
+{
+    return TRUE;
+}
+
+
+gboolean gimp_register_save_handler(const gchar *procedure_name,
+                                    const gchar *extensions,
+                                    const gchar *prefixes)
+{
+    return TRUE;
+}
+
+
+static StubData *find_data(const gchar *identifier)
+{
+    guint i;
+
+    if (stub_data == NULL)
+        return (NULL);
+    for (i = 0; i < stub_data->len; i++)
+    {
+        if (!g_strcmp0(((StubData*) g_ptr_array_index(stub_data, i))->identifier, identifier))
+            return ((StubData*) g_ptr_array_index(stub_data, i));
+    }
+    return (NULL);
+}
+
+
+gboolean gimp_get_data(const gchar *identifier, gpointer data)
+{
+    StubData *entry = find_data(identifier);
+
+    if (entry == NULL)
+        return FALSE;
+    memcpy(data, entry->data, entry->size);
+    return TRUE;
+}
+
+
+gint gimp_get_data_size(const gchar *identifier)
+{
+    StubData *entry = find_data(identifier);
+
+    return ((entry != NULL) ? (gint) entry->size : 0);
+}
+
+
+gboolean gimp_set_data(const gchar *identifier, gconstpointer data, guint32 bytes)
+{
+    StubData *entry = find_data(identifier);
+
+    if (entry == NULL)
+    {
+        if (stub_data == NULL)
+            stub_data = g_ptr_array_new();
+        entry = g_new0(StubData, 1);
+        entry->identifier = g_strdup(identifier);
+        g_ptr_array_add(stub_data, entry);
+    }
+    g_free(entry->data);
+    entry->data = g_malloc(MAX(1, bytes));
+    memcpy(entry->data, data, bytes);
+    entry->size = bytes;
+    return TRUE;
+}
+
+
+gboolean gimp_displays_flush(void)
+{
+    return TRUE;
+}
+
+
+gboolean gimp_progress_init_printf(const gchar *format, ...)
+{
+    return TRUE;
+}
+
+
+gboolean gimp_progress_update(gdouble percentage)
+{
+    return TRUE;
+}
+
+
+gint32 gimp_image_new(gint width, gint height, GimpImageBaseType type)
+{
+    StubImage *image;
+
+    if (stub_num_images >= STUB_MAX_IMAGES)
+    {
+        fprintf(stderr, "libgimp stub: too many images\n");
+        abort();
+    }
+    image = &stub_images[stub_num_images];
+    memset(image, 0, sizeof(StubImage));
+    image->used         = TRUE;
+    image->width        = width;
+    image->height       = height;
+    image->base_type    = type;
+    image->layers       = g_array_new(FALSE, FALSE, sizeof(gint32));
+    image->undo_enabled = TRUE;
+    return (stub_num_images++);
+}
+
+
+gboolean gimp_image_delete(gint32 image_id)
+{
+    StubImage *image = get_image(image_id);
+    gint32 i;
+
+    // Frees the pixels of all layers, inserted or not. The containers go
+    // away with the image, no need to remove the items from them.
+    for (i = 1; i < stub_num_items; i++)
+    {
+        if (stub_items[i].used && (stub_items[i].image_id == image_id))
+            stub_items[i].parent_id = -1;
+    }
+    for (i = 1; i < stub_num_items; i++)
+    {
+        if (stub_items[i].used && (stub_items[i].image_id == image_id))
+            gimp_item_delete(i);
+    }
+    g_array_free(image->layers, TRUE);
+    g_free(image->filename);
+    image->used = FALSE;
+    return TRUE;
+}
+
+
+gboolean gimp_image_is_valid(gint32 image_id)
+{
+    return ((image_id > 0) && (image_id < stub_num_images) && stub_images[image_id].used);
+}
+
+
+gint gimp_image_width(gint32 image_id)
+{
+    return (get_image(image_id)->width);
+}
+
+
+gint gimp_image_height(gint32 image_id)
+{
+    return (get_image(image_id)->height);
+}
+
+
+GimpImageBaseType gimp_image_base_type(gint32 image_id)
+{
+    return (get_image(image_id)->base_type);
+}
+
+
+gchar *gimp_image_get_filename(gint32 image_id)
+{
+    return (g_strdup(get_image(image_id)->filename));
+}
+
+
+gboolean gimp_image_set_filename(gint32 image_id, const gchar *filename)
+{
+    StubImage *image = get_image(image_id);
+
+    g_free(image->filename);
+    image->filename = g_strdup(filename);
+    return TRUE;
+}
+
+
+gint *gimp_image_get_layers(gint32 image_id, gint *num_layers)
+{
+    GArray *layers = get_image(image_id)->layers;
+
+    *num_layers = layers->len;
+    return ((gint*) g_memdup(layers->data, sizeof(gint32)*MAX(1, layers->len)));
+}
+
+
+gboolean gimp_image_insert_layer(gint32 image_id, gint32 layer_id,
+                                 gint32 parent_id, gint position)
+{
+    StubItem *item = get_item(layer_id);
+    GArray *container = get_container(image_id, parent_id);
+
+    if (item->parent_id >= 0)
+        return FALSE;
+    if (get_image(image_id)->undo_enabled)
+        stub_counters.inserts_with_undo++;
+    if ((position < 0) || (position > container->len))
+        position = container->len;
+    g_array_insert_val(container, position, layer_id);
+    item->parent_id = MAX(0, parent_id);
+    return TRUE;
+}
+
+
+gboolean gimp_image_set_active_layer(gint32 image_id, gint32 active_layer_id)
+{
+    return TRUE;
+}
+
+
+gboolean gimp_image_undo_disable(gint32 image_id)
+{
+    get_image(image_id)->undo_enabled = FALSE;
+    return TRUE;
+}
+
+
+gboolean gimp_image_undo_enable(gint32 image_id)
+{
+    get_image(image_id)->undo_enabled = TRUE;
+    return TRUE;
+}
+
+
+gboolean gimp_image_undo_group_start(gint32 image_id)
+{
+    return TRUE;
+}
+
+
+gboolean gimp_image_undo_group_end(gint32 image_id)
+{
+    return TRUE;
+}
+
+
+gint32 gimp_layer_new(gint32 image_id, const gchar *name,
+                      gint width, gint height, GimpImageType type,
+                      gdouble opacity, GimpLayerModeEffects mode)
+{
+    gint32 layer_id = new_item(image_id, name);
+    StubItem *item = get_item(layer_id);
+
+    item->type   = type;
+    item->width  = width;
+    item->height = height;
+    item->pixels = (guchar*) g_malloc0((gsize) width*height*get_bpp(type));
+    return (layer_id);
+}
+
+
+gchar *gimp_item_get_name(gint32 item_id)
+{
+    return (g_strdup(get_item(item_id)->name));
+}
+
+
+gboolean gimp_item_is_group(gint32 item_id)
+{
+    return (get_item(item_id)->is_group);
+}
+
+
+gint *gimp_item_get_children(gint32 item_id, gint *num_children)
+{
+    GArray *children = get_item(item_id)->children;
+
+    *num_children = children->len;
+    return ((gint*) g_memdup(children->data, sizeof(gint32)*MAX(1, children->len)));
+}
+
+
+gboolean gimp_item_delete(gint32 item_id)
+{
+    StubItem *item = get_item(item_id);
+    GArray *container;
+    guint i;
+
+    if (item->parent_id >= 0)
+    {
+        container = get_container(item->image_id, item->parent_id);
+        for (i = 0; i < container->len; i++)
+        {
+            if (g_array_index(container, gint32, i) == item_id)
+            {
+                g_array_remove_index(container, i);
+                break;
+            }
+        }
+    }
+    if (item->children)
+        g_array_free(item->children, TRUE);
+    g_free(item->pixels);
+    g_free(item->name);
+    item->used = FALSE;
+    return TRUE;
+}
+
+
+gint gimp_drawable_width(gint32 drawable_id)
+{
+    return (get_item(drawable_id)->width);
+}
+
+
+gint gimp_drawable_height(gint32 drawable_id)
+{
+    return (get_item(drawable_id)->height);
+}
+
+
+gint gimp_drawable_bpp(gint32 drawable_id)
+{
+    return (get_bpp(get_item(drawable_id)->type));
+}
+
+
+GimpImageType gimp_drawable_type(gint32 drawable_id)
+{
+    return (get_item(drawable_id)->type);
+}
+
+
+gboolean gimp_drawable_offsets(gint32 drawable_id, gint *offset_x, gint *offset_y)
+{
+    StubItem *item = get_item(drawable_id);
+
+    *offset_x = item->offset_x;
+    *offset_y = item->offset_y;
+    return TRUE;
+}
+
+
+GimpDrawable *gimp_drawable_get(gint32 drawable_id)
+{
+    StubItem *item = get_item(drawable_id);
+    GimpDrawable *drawable = g_new0(GimpDrawable, 1);
+
+    drawable->drawable_id = drawable_id;
+    drawable->width       = item->width;
+    drawable->height      = item->height;
+    drawable->bpp         = get_bpp(item->type);
+    drawable->ntile_cols  = (item->width  + STUB_TILE_SIZE - 1) / STUB_TILE_SIZE;
+    drawable->ntile_rows  = (item->height + STUB_TILE_SIZE - 1) / STUB_TILE_SIZE;
+    stub_counters.live_drawables++;
+    return (drawable);
+}
+
+
+void gimp_drawable_flush(GimpDrawable *drawable)
+{
+}
+
+
+void gimp_drawable_detach(GimpDrawable *drawable)
+{
+    stub_counters.live_drawables--;
+    g_free(drawable);
+}
+
+
+void gimp_pixel_rgn_init(GimpPixelRgn *pr, GimpDrawable *drawable,
+                         gint x, gint y, gint width, gint height,
+                         gint dirty, gint shadow)
+{
+    memset(pr, 0, sizeof(GimpPixelRgn));
+    pr->drawable = drawable;
+    pr->bpp      = drawable->bpp;
+    pr->x        = x;
+    pr->y        = y;
+    pr->w        = width;
+    pr->h        = height;
+    pr->dirty    = dirty;
+    pr->shadow   = shadow;
+}
+
+
+void gimp_pixel_rgn_get_rect(GimpPixelRgn *pr, guchar *buf,
+                             gint x, gint y, gint width, gint height)
+{
+    StubItem *item = get_item(pr->drawable->drawable_id);
+    const gsize row_size = (gsize) width * pr->bpp;
+    gint r;
+
+    stub_counters.get_rect_calls++;
+    if (!valid_rect(item, x, y, width, height))
+        return;
+    check_rect(item, x, y, width, height);
+    for (r = 0; r < height; r++)
+        memcpy(buf + r*row_size,
+               item->pixels + ((gsize) (y + r)*item->width + x)*pr->bpp,
+               row_size);
+}
+
+
+void gimp_pixel_rgn_set_rect(GimpPixelRgn *pr, const guchar *buf,
+                             gint x, gint y, gint width, gint height)
+{
+    StubItem *item = get_item(pr->drawable->drawable_id);
+    const gsize row_size = (gsize) width * pr->bpp;
+    gint r;
+
+    stub_counters.set_rect_calls++;
+    if (!valid_rect(item, x, y, width, height))
+        return;
+    check_rect(item, x, y, width, height);
+    for (r = 0; r < height; r++)
+        memcpy(item->pixels + ((gsize) (y + r)*item->width + x)*pr->bpp,
+               buf + r*row_size,
+               row_size);
+}
@@ -0,0 +1,54 @@
+// ##### BEGIN GPL LICENSE BLOCK #####
+//
+//  This program is free software; you can redistribute it and/or
+//  modify it under the terms of the GNU General Public License
+//  as published by the Free Software Foundation; either version 3
+//  of the License, or (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with this program; if not, write to the Free Software Foundation,
+//  Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+//
+// ##### END GPL LICENSE BLOCK #####
+
+// Test access to the libgimp stand-in, images and layers are set up
+// through the regular libgimp calls and these helpers
+
+#ifndef LIBGIMP_STUB_H
+#define LIBGIMP_STUB_H
+
+#include <libgimp/gimp.h>
+
+// Tile size of the stand-in, same as gimp's
+#define STUB_TILE_SIZE 64
+
+// What the plug-in asked the stand-in to do
+typedef struct
+{
+    gint get_rect_calls;
+    gint set_rect_calls;
+    gint misaligned_rects;          // not on the drawable's tile grid
+    gint invalid_rects;             // outside of the drawable
+    gint inserts_with_undo;         // layers inserted with undo enabled
+    gint live_drawables;            // gimp_drawable_get() without detach
+} StubCounters;
+
+extern StubCounters stub_counters;
+
+void     stub_reset_counters(void);
+
+// Pixels of a layer, width*height*bpp bytes, row by row
+guchar  *stub_layer_pixels(gint32 layer_id);
+
+void     stub_layer_set_offsets(gint32 layer_id, gint offset_x, gint offset_y);
+
+gint32   stub_layer_group_new(gint32 image_id, const gchar *name);
+
+gboolean stub_image_undo_is_enabled(gint32 image_id);
+
+#endif
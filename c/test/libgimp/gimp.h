@@ -0,0 +1,249 @@
+// ##### BEGIN GPL LICENSE BLOCK #####
+//
+//  This program is free software; you can redistribute it and/or
+//  modify it under the terms of the GNU General Public License
+//  as published by the Free Software Foundation; either version 3
+//  of the License, or (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with this program; if not, write to the Free Software Foundation,
+//  Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+//
+// ##### END GPL LICENSE BLOCK #####
+
+// In-process stand-in for the parts of libgimp 2.8 used by the plug-in,
+// so it can be tested without a running gimp. Only declares what the
+// plug-in calls, with the same signatures as libgimp.
+
+#ifndef LIBGIMP_STUB_GIMP_H
+#define LIBGIMP_STUB_GIMP_H
+
+#include <glib.h>
+
+#define GIMP_MAX_IMAGE_SIZE 262144
+
+typedef enum
+{
+    GIMP_PDB_EXECUTION_ERROR,
+    GIMP_PDB_CALLING_ERROR,
+    GIMP_PDB_PASS_THROUGH,
+    GIMP_PDB_SUCCESS,
+    GIMP_PDB_CANCEL
+} GimpPDBStatusType;
+
+typedef enum
+{
+    GIMP_RUN_INTERACTIVE,
+    GIMP_RUN_NONINTERACTIVE,
+    GIMP_RUN_WITH_LAST_VALS
+} GimpRunMode;
+
+typedef enum
+{
+    GIMP_PDB_INT32,
+    GIMP_PDB_INT16,
+    GIMP_PDB_INT8,
+    GIMP_PDB_FLOAT,
+    GIMP_PDB_STRING,
+    GIMP_PDB_INT32ARRAY,
+    GIMP_PDB_INT16ARRAY,
+    GIMP_PDB_INT8ARRAY,
+    GIMP_PDB_FLOATARRAY,
+    GIMP_PDB_STRINGARRAY,
+    GIMP_PDB_COLOR,
+    GIMP_PDB_ITEM,
+    GIMP_PDB_DISPLAY,
+    GIMP_PDB_IMAGE,
+    GIMP_PDB_LAYER,
+    GIMP_PDB_CHANNEL,
+    GIMP_PDB_DRAWABLE,
+    GIMP_PDB_SELECTION,
+    GIMP_PDB_COLORARRAY,
+    GIMP_PDB_VECTORS,
+    GIMP_PDB_PARASITE,
+    GIMP_PDB_STATUS
+} GimpPDBArgType;
+
+typedef enum
+{
+    GIMP_PLUGIN = 1
+} GimpPDBProcType;
+
+typedef enum
+{
+    GIMP_RGB,
+    GIMP_GRAY,
+    GIMP_INDEXED
+} GimpImageBaseType;
+
+typedef enum
+{
+    GIMP_RGB_IMAGE,
+    GIMP_RGBA_IMAGE,
+    GIMP_GRAY_IMAGE,
+    GIMP_GRAYA_IMAGE,
+    GIMP_INDEXED_IMAGE,
+    GIMP_INDEXEDA_IMAGE
+} GimpImageType;
+
+typedef enum
+{
+    GIMP_NORMAL_MODE
+} GimpLayerModeEffects;
+
+typedef struct
+{
+    GimpPDBArgType  type;
+    gchar          *name;
+    gchar          *description;
+} GimpParamDef;
+
+typedef union
+{
+    gint32             d_int32;
+    gchar             *d_string;
+    gint32             d_image;
+    gint32             d_drawable;
+    GimpPDBStatusType  d_status;
+} GimpParamData;
+
+typedef struct
+{
+    GimpPDBArgType type;
+    GimpParamData  data;
+} GimpParam;
+
+typedef void (*GimpInitProc)(void);
+typedef void (*GimpQuitProc)(void);
+typedef void (*GimpQueryProc)(void);
+typedef void (*GimpRunProc)(const gchar      *name,
+                            gint              n_params,
+                            const GimpParam  *param,
+                            gint             *n_return_vals,
+                            GimpParam       **return_vals);
+
+typedef struct
+{
+    GimpInitProc  init_proc;
+    GimpQuitProc  quit_proc;
+    GimpQueryProc query_proc;
+    GimpRunProc   run_proc;
+} GimpPlugInInfo;
+
+typedef struct
+{
+    gint32 drawable_id;
+    guint  width;
+    guint  height;
+    guint  bpp;
+    guint  ntile_rows;
+    guint  ntile_cols;
+} GimpDrawable;
+
+typedef struct
+{
+    guchar       *data;
+    GimpDrawable *drawable;
+    gint          bpp;
+    gint          rowstride;
+    gint          x, y;
+    gint          w, h;
+    guint         dirty : 1;
+    guint         shadow : 1;
+} GimpPixelRgn;
+
+// The test links its own main()
+#define MAIN()
+
+// Tiles
+guint    gimp_tile_width(void);
+guint    gimp_tile_height(void);
+void     gimp_tile_cache_ntiles(gulong ntiles);
+
+// Procedures
+void     gimp_install_procedure(const gchar        *name,
+                                const gchar        *blurb,
+                                const gchar        *help,
+                                const gchar        *author,
+                                const gchar        *copyright,
+                                const gchar        *date,
+                                const gchar        *menu_label,
+                                const gchar        *image_types,
+                                GimpPDBProcType     type,
+                                gint                n_params,
+                                gint                n_return_vals,
+                                const GimpParamDef *params,
+                                const GimpParamDef *return_vals);
+gboolean gimp_plugin_menu_register(const gchar *procedure_name,
+                                   const gchar *menu_path);
+gboolean gimp_register_file_handler_mime(const gchar *procedure_name,
+                                         const gchar *mime_type);
+gboolean gimp_register_load_handler(const gchar *procedure_name,
+                                    const gchar *extensions,
+                                    const gchar *prefixes);
+gboolean gimp_register_save_handler(const gchar *procedure_name,
+                                    const gchar *extensions,
+                                    const gchar *prefixes);
+
+// Session data
+gboolean gimp_get_data(const gchar *identifier, gpointer data);
+gint     gimp_get_data_size(const gchar *identifier);
+gboolean gimp_set_data(const gchar *identifier, gconstpointer data, guint32 bytes);
+
+// User interface
+gboolean gimp_displays_flush(void);
+gboolean gimp_progress_init_printf(const gchar *format, ...) G_GNUC_PRINTF(1, 2);
+gboolean gimp_progress_update(gdouble percentage);
+
+// Images
+gint32            gimp_image_new(gint width, gint height, GimpImageBaseType type);
+gboolean          gimp_image_delete(gint32 image_ID);
+gboolean          gimp_image_is_valid(gint32 image_ID);
+gint              gimp_image_width(gint32 image_ID);
+gint              gimp_image_height(gint32 image_ID);
+GimpImageBaseType gimp_image_base_type(gint32 image_ID);
+gchar            *gimp_image_get_filename(gint32 image_ID);
+gboolean          gimp_image_set_filename(gint32 image_ID, const gchar *filename);
+gint             *gimp_image_get_layers(gint32 image_ID, gint *num_layers);
+gboolean          gimp_image_insert_layer(gint32 image_ID, gint32 layer_ID,
+                                          gint32 parent_ID, gint position);
+gboolean          gimp_image_set_active_layer(gint32 image_ID, gint32 active_layer_ID);
+gboolean          gimp_image_undo_disable(gint32 image_ID);
+gboolean          gimp_image_undo_enable(gint32 image_ID);
+gboolean          gimp_image_undo_group_start(gint32 image_ID);
+gboolean          gimp_image_undo_group_end(gint32 image_ID);
+
+// Layers and items
+gint32            gimp_layer_new(gint32 image_ID, const gchar *name,
+                                 gint width, gint height, GimpImageType type,
+                                 gdouble opacity, GimpLayerModeEffects mode);
+gchar            *gimp_item_get_name(gint32 item_ID);
+gboolean          gimp_item_is_group(gint32 item_ID);
+gint             *gimp_item_get_children(gint32 item_ID, gint *num_children);
+gboolean          gimp_item_delete(gint32 item_ID);
+
+// Drawables
+gint              gimp_drawable_width(gint32 drawable_ID);
+gint              gimp_drawable_height(gint32 drawable_ID);
+gint              gimp_drawable_bpp(gint32 drawable_ID);
+GimpImageType     gimp_drawable_type(gint32 drawable_ID);
+gboolean          gimp_drawable_offsets(gint32 drawable_ID, gint *offset_x, gint *offset_y);
+GimpDrawable     *gimp_drawable_get(gint32 drawable_ID);
+void              gimp_drawable_flush(GimpDrawable *drawable);
+void              gimp_drawable_detach(GimpDrawable *drawable);
+
+// Pixel regions
+void              gimp_pixel_rgn_init(GimpPixelRgn *pr, GimpDrawable *drawable,
+                                      gint x, gint y, gint width, gint height,
+                                      gint dirty, gint shadow);
+void              gimp_pixel_rgn_get_rect(GimpPixelRgn *pr, guchar *buf,
+                                          gint x, gint y, gint width, gint height);
+void              gimp_pixel_rgn_set_rect(GimpPixelRgn *pr, const guchar *buf,
+                                          gint x, gint y, gint width, gint height);
+
+#endif
@@ -0,0 +1,1204 @@
+// ##### BEGIN GPL LICENSE BLOCK #####
+//
+//  This program is free software; you can redistribute it and/or
+//  modify it under the terms of the GNU General Public License
+//  as published by the Free Software Foundation; either version 3
+//  of the License, or (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with this program; if not, write to the Free Software Foundation,
+//  Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+//
+// ##### END GPL LICENSE BLOCK #####
+
+// Tests of the plug-in against the libgimp stand-in. The plug-in source is
+// included to reach its static functions.
+//
+// Usage: test-bioplt <output directory>
+
+#include "../src/file-bioplt.c"
+
+#include "libgimp-stub.h"
+
+static gint num_failures = 0;
+static gint num_messages = 0;
+static gchar *last_message = NULL;
+
+#define CHECK(condition, ...)                   \
+    do                                          \
+    {                                           \
+        if (condition)                          \
+        {                                       \
+            g_print("ok      ");                \
+        }                                       \
+        else                                    \
+        {                                       \
+            g_print("FAILED  ");                \
+            num_failures++;                     \
+        }                                       \
+        g_print(__VA_ARGS__);                   \
+        g_print("\n");                          \
+    } while (0)
+
+
+static void count_message(const gchar    *log_domain,
+                          GLogLevelFlags  log_level,
+                          const gchar    *message,
+                          gpointer        user_data)
+{
+    num_messages++;
+    g_free(last_message);
+    last_message = g_strdup(message);
+    if (g_getenv("PLT_TEST_VERBOSE"))
+        g_printerr("** Message: %s", message);
+}
+
+
+// Deterministic pixel data, the same for every run
+static guint32 random_state = 12345;
+
+static uint8_t random_byte(void)
+{
+    random_state = random_state * 1103515245u + 12345u;
+    return ((random_state >> 16) & 0xFF);
+}
+
+
+static gchar *test_filename(const gchar *dir, const gchar *name)
+{
+    return (g_build_filename(dir, name, NULL));
+}
+
+
+static uint8_t *read_file(const gchar *filename, gsize *size)
+{
+    FILE *stream = g_fopen(filename, "rb");
+    uint8_t *data;
+    long length;
+
+    *size = 0;
+    if (stream == 0)
+        return (NULL);
+    fseek(stream, 0, SEEK_END);
+    length = ftell(stream);
+    fseek(stream, 0, SEEK_SET);
+    data = (uint8_t*) g_malloc(MAX(1, length));
+    if (fread(data, 1, length, stream) < (gsize) length)
+    {
+        fclose(stream);
+        g_free(data);
+        return (NULL);
+    }
+    fclose(stream);
+    *size = length;
+    return (data);
+}
+
+
+static gboolean same_files(const gchar *filename1, const gchar *filename2)
+{
+    gsize size1, size2;
+    uint8_t *data1 = read_file(filename1, &size1);
+    uint8_t *data2 = read_file(filename2, &size2);
+    gboolean result;
+
+    result = (data1 != NULL) && (data2 != NULL) && (size1 == size2) &&
+             !memcmp(data1, data2, size1);
+    g_free(data1);
+    g_free(data2);
+    return (result);
+}
+
+
+// Plt with random values and layer ids below num_ids
+static void write_random_plt(const gchar *filename, uint32_t width, uint32_t height,
+                             uint8_t num_ids)
+{
+    uint8_t header[PLT_HEADER_SIZE];
+    uint8_t pixel[2];
+    FILE *stream = g_fopen(filename, "wb");
+    guint64 i;
+
+    plt_make_header(header, PLT_HEADER_VERSION, width, height);
+    fwrite(header, 1, PLT_HEADER_SIZE, stream);
+    for (i = 0; i < (guint64) width*height; i++)
+    {
+        pixel[0] = random_byte();
+        pixel[1] = random_byte() % num_ids;
+        fwrite(pixel, 1, 2, stream);
+    }
+    fclose(stream);
+}
+
+
+// Layer with random pixels, added on top of the others in the group
+static gint32 add_child_layer(gint32 image_id, gint32 parent_id, const gchar *name,
+                              gint width, gint height, GimpImageType type,
+                              gint offset_x, gint offset_y)
+{
+    gint32 layer_id;
+    guchar *pixels;
+    gsize i;
+
+    layer_id = gimp_layer_new(image_id, name, width, height, type, 100.0, GIMP_NORMAL_MODE);
+    pixels = stub_layer_pixels(layer_id);
+    for (i = 0; i < (gsize) width*height*gimp_drawable_bpp(layer_id); i++)
+        pixels[i] = random_byte();
+    stub_layer_set_offsets(layer_id, offset_x, offset_y);
+    gimp_image_insert_layer(image_id, layer_id, parent_id, 0);
+    return (layer_id);
+}
+
+
+// Top level layer with random pixels, added on top of the others
+static gint32 add_layer(gint32 image_id, const gchar *name,
+                        gint width, gint height, GimpImageType type,
+                        gint offset_x, gint offset_y)
+{
+    return (add_child_layer(image_id, 0, name, width, height, type, offset_x, offset_y));
+}
+
+
+// Top level layer group, added on top of the others
+static gint32 add_group(gint32 image_id, gint32 parent_id, const gchar *name)
+{
+    gint32 group_id = stub_layer_group_new(image_id, name);
+
+    gimp_image_insert_layer(image_id, group_id, parent_id, 0);
+    return (group_id);
+}
+
+
+// Straightforward version of what plt_save writes for the given layers,
+// composited in this order, as a complete plt file
+static uint8_t *reference_plt(gint32 image_id, const gint32 *layer_ids,
+                              const gint *plt_ids, gint num_layers, gsize *size)
+{
+    const gint width  = gimp_image_width(image_id);
+    const gint height = gimp_image_height(image_id);
+    uint8_t *plt;
+    uint8_t *pixel;
+    guchar *px;
+    gint l, x, y, bpp, offset_x, offset_y;
+    gboolean has_alpha, is_rgb;
+    GimpImageType type;
+
+    *size = PLT_HEADER_SIZE + 2 * (gsize) width * height;
+    plt = (uint8_t*) g_malloc(*size);
+    plt_make_header(plt, PLT_HEADER_VERSION, width, height);
+    for (y = 0; y < height; y++)
+    {
+        for (x = 0; x < width; x++)
+        {
+            plt[PLT_HEADER_SIZE + 2*((gsize) y*width + x)]     = 255;
+            plt[PLT_HEADER_SIZE + 2*((gsize) y*width + x) + 1] = 0;
+        }
+    }
+    for (l = 0; l < num_layers; l++)
+    {
+        type = gimp_drawable_type(layer_ids[l]);
+        bpp = gimp_drawable_bpp(layer_ids[l]);
+        has_alpha = (type == GIMP_RGBA_IMAGE) || (type == GIMP_GRAYA_IMAGE);
+        is_rgb = (type == GIMP_RGB_IMAGE) || (type == GIMP_RGBA_IMAGE);
+        gimp_drawable_offsets(layer_ids[l], &offset_x, &offset_y);
+        for (y = 0; y < gimp_drawable_height(layer_ids[l]); y++)
+        {
+            for (x = 0; x < gimp_drawable_width(layer_ids[l]); x++)
+            {
+                if ((x + offset_x < 0) || (x + offset_x >= width) ||
+                    (y + offset_y < 0) || (y + offset_y >= height))
+                    continue;
+                px = stub_layer_pixels(layer_ids[l]) +
+                     ((gsize) y*gimp_drawable_width(layer_ids[l]) + x)*bpp;
+                if (has_alpha && (px[bpp-1] <= PLT_ALPHA_THRESHOLD))
+                    continue;
+                // Plts are stored bottom-up
+                pixel = plt + PLT_HEADER_SIZE +
+                        2*((gsize) (height - 1 - y - offset_y)*width + x + offset_x);
+                pixel[0] = is_rgb ? (px[0] + px[1] + px[2])/3 : px[0];
+                pixel[1] = plt_ids[l];
+            }
+        }
+    }
+    return (plt);
+}
+
+
+// Compares a saved plt with the reference of the given layers
+static gboolean matches_layers(gint32 image_id, const gchar *filename,
+                               const gint32 *layer_ids, const gint *plt_ids,
+                               gint num_layers)
+{
+    uint8_t *expected, *actual;
+    gsize expected_size, actual_size;
+    gboolean result;
+
+    expected = reference_plt(image_id, layer_ids, plt_ids, num_layers, &expected_size);
+    actual = read_file(filename, &actual_size);
+    result = (actual != NULL) && (actual_size == expected_size) &&
+             !memcmp(actual, expected, expected_size);
+    g_free(actual);
+    g_free(expected);
+    return (result);
+}
+
+
+// Compares a saved plt with the reference of the top level plt layers,
+// detected like plt_save does
+static gboolean matches_reference(gint32 image_id, const gchar *filename)
+{
+    gint num_layers, l, i, count = 0;
+    gint *layer_ids = gimp_image_get_layers(image_id, &num_layers);
+    gint32 plt_layers[PLT_NUM_LAYERS];
+    gint plt_ids[PLT_NUM_LAYERS];
+    gchar *name;
+    gboolean result;
+
+    for (l = 0; (l < num_layers) && (count < PLT_NUM_LAYERS); l++)
+    {
+        name = gimp_item_get_name(layer_ids[l]);
+        for (i = 0; i < PLT_NUM_LAYERS; i++)
+        {
+            if (!g_ascii_strcasecmp(PLT_LAYERS[i], name))
+            {
+                plt_layers[count] = layer_ids[l];
+                plt_ids[count++] = i;
+                break;
+            }
+        }
+        g_free(name);
+    }
+    // Topmost layers if no names match
+    for (l = 0; (count == 0) && (l < MIN(num_layers, PLT_NUM_LAYERS)); l++)
+    {
+        plt_layers[l] = layer_ids[l];
+        plt_ids[l] = l;
+    }
+    if (count == 0)
+        count = MIN(num_layers, PLT_NUM_LAYERS);
+    g_free(layer_ids);
+
+    result = matches_layers(image_id, filename, plt_layers, plt_ids, count);
+    return (result);
+}
+
+
+static gdouble seconds_since(gint64 start)
+{
+    return ((g_get_monotonic_time() - start) / 1e6);
+}
+
+
+// Load -> save has to reproduce the file byte by byte
+static void test_round_trip(const gchar *dir)
+{
+    const uint32_t sizes[][2] = {{1, 1}, {3, 5}, {64, 64}, {130, 67}, {257, 300}};
+    gchar *in_filename, *out_filename, *name;
+    gint32 image_id;
+    GimpPDBStatusType status;
+    unsigned int s;
+
+    for (s = 0; s < G_N_ELEMENTS(sizes); s++)
+    {
+        name = g_strdup_printf("round-trip-%u.plt", s);
+        in_filename = test_filename(dir, name);
+        g_free(name);
+        name = g_strdup_printf("round-trip-%u-saved.plt", s);
+        out_filename = test_filename(dir, name);
+        g_free(name);
+
+        write_random_plt(in_filename, sizes[s][0], sizes[s][1], PLT_NUM_LAYERS);
+        image_id = -1;
+        status = plt_load(in_filename, &image_id);
+        CHECK(status == GIMP_PDB_SUCCESS, "load %ux%u", sizes[s][0], sizes[s][1]);
+        if (status == GIMP_PDB_SUCCESS)
+        {
+            status = plt_save(out_filename, image_id, FALSE, NULL);
+            CHECK((status == GIMP_PDB_SUCCESS) && same_files(in_filename, out_filename),
+                  "load -> save is byte identical %ux%u", sizes[s][0], sizes[s][1]);
+            gimp_image_delete(image_id);
+        }
+        g_free(out_filename);
+        g_free(in_filename);
+    }
+}
+
+
+// Layers partially or completely outside of the image, with offsets on
+// both sides, for every layer type
+static void test_layer_bounds(const gchar *dir)
+{
+    const struct
+    {
+        gint width, height, x, y;
+    } cases[] =
+    {
+        { 50,  40,   0,   0},  // inside
+        { 50,  40, -10,  -5},  // top left outside
+        { 50,  40,  30,  20},  // bottom right outside
+        {200, 200, -20, -30},  // larger than the image
+        { 50,  40, -60,   0},  // left of the image
+        { 50,  40,  80,   0},  // right of the image
+        { 20,  20,  70,  50},  // at the bottom right corner
+        { 30, 200,  10, -30},  // taller than the image
+        { 50,  40,   0,  60},  // below the image
+        { 50,  40,   0, -40}   // above the image
+    };
+    const GimpImageType types[] = {GIMP_GRAY_IMAGE, GIMP_GRAYA_IMAGE,
+                                   GIMP_RGB_IMAGE, GIMP_RGBA_IMAGE};
+    const gchar *type_names[] = {"gray", "graya", "rgb", "rgba"};
+    gchar *filename, *name;
+    gint32 image_id;
+    GimpImageBaseType base_type;
+    GimpPDBStatusType status;
+    unsigned int c, t;
+
+    for (t = 0; t < G_N_ELEMENTS(types); t++)
+    {
+        base_type = ((types[t] == GIMP_RGB_IMAGE) || (types[t] == GIMP_RGBA_IMAGE)) ?
+                    GIMP_RGB : GIMP_GRAY;
+        for (c = 0; c < G_N_ELEMENTS(cases); c++)
+        {
+            image_id = gimp_image_new(80, 60, base_type);
+            add_layer(image_id, "hair", 80, 60,
+                      (base_type == GIMP_RGB) ? GIMP_RGBA_IMAGE : GIMP_GRAYA_IMAGE, 0, 0);
+            add_layer(image_id, "Metal1", cases[c].width, cases[c].height, types[t],
+                      cases[c].x, cases[c].y);
+            add_layer(image_id, "cloth2", 33, 21,
+                      (base_type == GIMP_RGB) ? GIMP_RGBA_IMAGE : GIMP_GRAYA_IMAGE, 5, 7);
+
+            name = g_strdup_printf("bounds-%u-%u.plt", t, c);
+            filename = test_filename(dir, name);
+            stub_reset_counters();
+            status = plt_save(filename, image_id, FALSE, NULL);
+            CHECK((status == GIMP_PDB_SUCCESS) && matches_reference(image_id, filename) &&
+                  (stub_counters.invalid_rects == 0),
+                  "%s layer %dx%d at %d,%d", type_names[t],
+                  cases[c].width, cases[c].height, cases[c].x, cases[c].y);
+            gimp_image_delete(image_id);
+            g_free(filename);
+            g_free(name);
+        }
+    }
+}
+
+
+// Layers without a composite kernel are skipped, whatever gimp reports
+static void test_unsupported_layers(const gchar *dir)
+{
+    const GimpImageType types[] = {GIMP_INDEXED_IMAGE, GIMP_INDEXEDA_IMAGE,
+                                   (GimpImageType) -1, (GimpImageType) 42};
+    gchar *filename = test_filename(dir, "unsupported.plt");
+    gint32 image_id, layer_id;
+    PltSource source;
+    unsigned int t;
+
+    image_id = gimp_image_new(16, 16, GIMP_GRAY);
+    add_layer(image_id, "skin", 16, 16, GIMP_GRAY_IMAGE, 0, 0);
+    for (t = 0; t < G_N_ELEMENTS(types); t++)
+    {
+        layer_id = add_layer(image_id, "hair", 16, 16, types[t], 0, 0);
+        CHECK(!init_source(&source, image_id, layer_id, 1, 1),
+              "layer of type %d is skipped", (gint) types[t]);
+    }
+    stub_reset_counters();
+    CHECK((plt_save(filename, image_id, FALSE, NULL) == GIMP_PDB_SUCCESS) &&
+          (stub_counters.live_drawables == 0),
+          "save with unsupported layers");
+    gimp_image_delete(image_id);
+    g_free(filename);
+}
+
+
+// Pixels with an alpha of at most the threshold are transparent
+static void test_alpha_threshold(const gchar *dir)
+{
+    const uint8_t gray_pixels[] = {10, PLT_ALPHA_THRESHOLD - 1,
+                                   20, PLT_ALPHA_THRESHOLD,
+                                   30, PLT_ALPHA_THRESHOLD + 1,
+                                   40, 0,
+                                   50, 255};
+    // Bottom row first, transparent pixels stay empty
+    const uint8_t gray_expected[] = {  7, 0,     7, 0,    7, 0,     7, 0,    7, 0,
+                                     255, 0,   255, 0,   30, 1,   255, 0,   50, 1};
+    const uint8_t rgb_pixels[] = {10, 20, 60, PLT_ALPHA_THRESHOLD,
+                                  10, 20, 60, PLT_ALPHA_THRESHOLD + 1};
+    const uint8_t rgb_expected[] = {255, 0,   30, 1};
+    gchar *filename = test_filename(dir, "alpha.plt");
+    gint32 image_id, layer_id;
+    uint8_t *data;
+    gsize size;
+
+    image_id = gimp_image_new(5, 2, GIMP_GRAY);
+    layer_id = add_layer(image_id, "skin", 5, 1, GIMP_GRAY_IMAGE, 0, 1);
+    memset(stub_layer_pixels(layer_id), 7, 5);
+    layer_id = add_layer(image_id, "hair", 5, 1, GIMP_GRAYA_IMAGE, 0, 0);
+    memcpy(stub_layer_pixels(layer_id), gray_pixels, sizeof(gray_pixels));
+    plt_save(filename, image_id, FALSE, NULL);
+    data = read_file(filename, &size);
+    CHECK((size == PLT_HEADER_SIZE + sizeof(gray_expected)) &&
+          !memcmp(data + PLT_HEADER_SIZE, gray_expected, sizeof(gray_expected)),
+          "alpha threshold edges, gray");
+    g_free(data);
+    gimp_image_delete(image_id);
+
+    // The value of rgb pixels is the mean of the channels
+    image_id = gimp_image_new(2, 1, GIMP_RGB);
+    layer_id = add_layer(image_id, "hair", 2, 1, GIMP_RGBA_IMAGE, 0, 0);
+    memcpy(stub_layer_pixels(layer_id), rgb_pixels, sizeof(rgb_pixels));
+    plt_save(filename, image_id, FALSE, NULL);
+    data = read_file(filename, &size);
+    CHECK((size == PLT_HEADER_SIZE + sizeof(rgb_expected)) &&
+          !memcmp(data + PLT_HEADER_SIZE, rgb_expected, sizeof(rgb_expected)),
+          "alpha threshold edges, rgb");
+    g_free(data);
+    gimp_image_delete(image_id);
+    g_free(filename);
+}
+
+
+// Without any plt layer names the topmost layers are used
+static void test_unnamed_layers(const gchar *dir)
+{
+    gchar *filename = test_filename(dir, "unnamed.plt");
+    gint32 image_id;
+
+    image_id = gimp_image_new(40, 30, GIMP_RGB);
+    add_layer(image_id, "Background", 40, 30, GIMP_RGB_IMAGE, 0, 0);
+    add_layer(image_id, "Layer", 20, 30, GIMP_RGBA_IMAGE, 3, 0);
+    CHECK((plt_save(filename, image_id, FALSE, NULL) == GIMP_PDB_SUCCESS) &&
+          matches_reference(image_id, filename),
+          "unnamed layers are used from the top");
+    gimp_image_delete(image_id);
+    g_free(filename);
+}
+
+
+// Tiny budgets force one band per row of tiles
+static void test_memory_budget(const gchar *dir)
+{
+    gchar *in_filename  = test_filename(dir, "banded.plt");
+    gchar *out_filename = test_filename(dir, "banded-saved.plt");
+    gint32 image_id = -1;
+    GimpPDBStatusType status;
+
+    g_setenv("PLT_MEMORY_BUDGET", "3000", TRUE);
+    write_random_plt(in_filename, 300, 200, PLT_NUM_LAYERS);
+    stub_reset_counters();
+    status = plt_load(in_filename, &image_id);
+    CHECK((status == GIMP_PDB_SUCCESS) &&
+          (stub_counters.set_rect_calls == 4*PLT_NUM_LAYERS),
+          "banded load, %d transfers", stub_counters.set_rect_calls);
+    if (status == GIMP_PDB_SUCCESS)
+    {
+        CHECK((plt_save(out_filename, image_id, FALSE, NULL) == GIMP_PDB_SUCCESS) &&
+              same_files(in_filename, out_filename),
+              "banded load -> save is byte identical");
+        gimp_image_delete(image_id);
+    }
+
+    image_id = gimp_image_new(150, 140, GIMP_RGB);
+    add_layer(image_id, "skin", 150, 140, GIMP_RGB_IMAGE, 0, 0);
+    add_layer(image_id, "hair", 100, 100, GIMP_RGBA_IMAGE, 30, -20);
+    add_layer(image_id, "metal2", 60, 100, GIMP_RGBA_IMAGE, 100, 70);
+    stub_reset_counters();
+    CHECK((plt_save(out_filename, image_id, FALSE, NULL) == GIMP_PDB_SUCCESS) &&
+          matches_reference(image_id, out_filename) &&
+          (stub_counters.get_rect_calls > 3),
+          "banded save of offset layers, %d transfers", stub_counters.get_rect_calls);
+    gimp_image_delete(image_id);
+
+    // Anything but a plain number of bytes is reported and ignored
+    g_setenv("PLT_MEMORY_BUDGET", "4096", TRUE);
+    CHECK(get_memory_budget() == 4096, "budget of 4096 bytes");
+    num_messages = 0;
+    g_setenv("PLT_MEMORY_BUDGET", "256M", TRUE);
+    CHECK((get_memory_budget() == PLT_MEMORY_BUDGET) && (num_messages == 1),
+          "budget with suffix is rejected");
+    num_messages = 0;
+    g_setenv("PLT_MEMORY_BUDGET", "-1", TRUE);
+    CHECK((get_memory_budget() == PLT_MEMORY_BUDGET) && (num_messages == 1),
+          "negative budget is rejected");
+    g_unsetenv("PLT_MEMORY_BUDGET");
+    CHECK(get_memory_budget() == PLT_MEMORY_BUDGET, "default budget");
+
+    g_free(out_filename);
+    g_free(in_filename);
+}
+
+
+// More layers matching plt layer names than there are plt layers
+static void test_duplicate_names(const gchar *dir)
+{
+    const gchar *names[] = {"skin", "SKIN", "Skin", "hair", "HAIR", "Hair",
+                            "metal1", "METAL1", "Metal1", "cloth1", "CLOTH1", "Cloth1"};
+    gchar *filename = test_filename(dir, "duplicates.plt");
+    gint32 image_id;
+    unsigned int i;
+
+    image_id = gimp_image_new(20, 20, GIMP_GRAY);
+    for (i = 0; i < G_N_ELEMENTS(names); i++)
+        add_layer(image_id, names[i], 10, 10, GIMP_GRAYA_IMAGE, i, i);
+    CHECK((plt_save(filename, image_id, FALSE, NULL) == GIMP_PDB_SUCCESS) &&
+          matches_reference(image_id, filename),
+          "only the top %d matching layers are used", PLT_NUM_LAYERS);
+    gimp_image_delete(image_id);
+    g_free(filename);
+}
+
+
+// Broken headers are rejected before anything is allocated
+static void test_invalid_files(const gchar *dir)
+{
+    gchar *filename = test_filename(dir, "invalid.plt");
+    uint8_t header[PLT_HEADER_SIZE];
+    gint32 image_id = -1;
+    FILE *stream;
+
+    write_random_plt(filename, 100, 100, PLT_NUM_LAYERS);
+    CHECK((truncate(filename, PLT_HEADER_SIZE + 2*100*100 - 1) == 0) &&
+          (plt_load(filename, &image_id) != GIMP_PDB_SUCCESS),
+          "truncated plt is rejected");
+
+    plt_make_header(header, PLT_HEADER_VERSION, 70000, 70000);
+    stream = g_fopen(filename, "r+b");
+    fwrite(header, 1, PLT_HEADER_SIZE, stream);
+    fclose(stream);
+    CHECK(plt_load(filename, &image_id) != GIMP_PDB_SUCCESS, "plt larger than its file is rejected");
+
+    plt_make_header(header, PLT_HEADER_VERSION, GIMP_MAX_IMAGE_SIZE + 1, 1);
+    stream = g_fopen(filename, "r+b");
+    fwrite(header, 1, PLT_HEADER_SIZE, stream);
+    fclose(stream);
+    CHECK(plt_load(filename, &image_id) != GIMP_PDB_SUCCESS, "plt larger than gimp allows is rejected");
+
+    plt_make_header(header, PLT_HEADER_VERSION, 0, 100);
+    stream = g_fopen(filename, "r+b");
+    fwrite(header, 1, PLT_HEADER_SIZE, stream);
+    fclose(stream);
+    CHECK(plt_load(filename, &image_id) != GIMP_PDB_SUCCESS, "empty plt is rejected");
+
+    plt_make_header(header, "PLT V2  ", 100, 100);
+    stream = g_fopen(filename, "r+b");
+    fwrite(header, 1, PLT_HEADER_SIZE, stream);
+    fclose(stream);
+    CHECK((plt_load(filename, &image_id) != GIMP_PDB_SUCCESS) && (image_id == -1),
+          "unknown version is rejected");
+    g_free(filename);
+}
+
+
+// Every top level group is a variant, top level layers are shared
+static void test_variants(const gchar *dir, gint width, gint height, const gchar *budget)
+{
+    gchar *filename, *name;
+    gint32 image_id, red_id, blue_id, inner_id;
+    gint32 red_layers[4], blue_layers[2];
+    const gint red_ids[4]  = {2, 4, 1, 0};  // metal1, cloth1, hair, skin
+    const gint blue_ids[2] = {1, 0};        // hair, skin
+    GimpPDBStatusType status;
+
+    if (budget)
+        g_setenv("PLT_MEMORY_BUDGET", budget, TRUE);
+    image_id = gimp_image_new(width, height, GIMP_RGB);
+    red_layers[3] = blue_layers[1] =
+        add_layer(image_id, "skin", width, height, GIMP_RGBA_IMAGE, 0, 0);
+    blue_id  = add_group(image_id, 0, "bl/ue");
+    red_id   = add_group(image_id, 0, "red");
+    blue_layers[0] = add_child_layer(image_id, blue_id, "Hair", width + 20, height/3,
+                                     GIMP_RGBA_IMAGE, -10, height - 20);
+    red_layers[2]  = add_child_layer(image_id, red_id, "hair", width/2, height/2,
+                                     GIMP_RGBA_IMAGE, 10, -5);
+    inner_id       = add_group(image_id, red_id, "inner");
+    red_layers[1]  = add_child_layer(image_id, inner_id, "cloth1", width/3, height,
+                                     GIMP_RGBA_IMAGE, width/2, 0);
+    red_layers[0]  = add_child_layer(image_id, red_id, "metal1", width/3, height/3,
+                                     GIMP_RGB_IMAGE, width/2, height/2);
+    // Not a plt layer
+    add_child_layer(image_id, red_id, "Layer", width, height, GIMP_RGB_IMAGE, 0, 0);
+
+    name = g_strdup_printf("variants-%dx%d", width, height);
+    filename = test_filename(dir, name);
+    stub_reset_counters();
+    status = plt_save_variants(filename, image_id);
+    CHECK((status == GIMP_PDB_SUCCESS) && (stub_counters.live_drawables == 0),
+          "save variants %dx%d%s", width, height, budget ? " in bands" : "");
+    g_free(filename);
+    g_free(name);
+
+    name = g_strdup_printf("variants-%dx%d-red.plt", width, height);
+    filename = test_filename(dir, name);
+    CHECK(matches_layers(image_id, filename, red_layers, red_ids, 4),
+          "variant with nested groups");
+    g_free(filename);
+    g_free(name);
+    name = g_strdup_printf("variants-%dx%d-bl_ue.plt", width, height);
+    filename = test_filename(dir, name);
+    CHECK(matches_layers(image_id, filename, blue_layers, blue_ids, 2),
+          "variant with a separator in its name");
+    g_free(filename);
+    g_free(name);
+
+    gimp_image_delete(image_id);
+    g_unsetenv("PLT_MEMORY_BUDGET");
+}
+
+
+static void test_variants_errors(const gchar *dir)
+{
+    gchar *filename, *name;
+    gint32 image_id;
+    gint i;
+
+    // Without a filename the variants go next to the image
+    image_id = gimp_image_new(16, 16, GIMP_GRAY);
+    add_layer(image_id, "skin", 16, 16, GIMP_GRAY_IMAGE, 0, 0);
+    add_group(image_id, 0, "empty");
+    filename = test_filename(dir, "image.xcf");
+    gimp_image_set_filename(image_id, filename);
+    g_free(filename);
+    filename = test_filename(dir, "image-empty.plt");
+    CHECK((plt_save_variants(NULL, image_id) == GIMP_PDB_SUCCESS) &&
+          g_file_test(filename, G_FILE_TEST_IS_REGULAR),
+          "variants are saved next to the image");
+    g_free(filename);
+    gimp_image_delete(image_id);
+
+    num_messages = 0;
+    image_id = gimp_image_new(16, 16, GIMP_GRAY);
+    add_layer(image_id, "skin", 16, 16, GIMP_GRAY_IMAGE, 0, 0);
+    filename = test_filename(dir, "no-groups.plt");
+    CHECK((plt_save_variants(filename, image_id) != GIMP_PDB_SUCCESS) && (num_messages == 1),
+          "images without groups have no variants");
+    g_free(filename);
+    for (i = 0; i <= PLT_MAX_VARIANTS; i++)
+    {
+        name = g_strdup_printf("v%d", i);
+        add_group(image_id, 0, name);
+        g_free(name);
+    }
+    num_messages = 0;
+    filename = test_filename(dir, "too-many.plt");
+    CHECK((plt_save_variants(filename, image_id) != GIMP_PDB_SUCCESS) && (num_messages == 1),
+          "more than %d variants are rejected", PLT_MAX_VARIANTS);
+    g_free(filename);
+    gimp_image_delete(image_id);
+}
+
+
+// Plt data of a file in image row order, without header
+static uint8_t *read_plt_rows(const gchar *filename, uint32_t width, uint32_t height)
+{
+    gsize size, row_size = 2 * (gsize) width;
+    uint8_t *file_data = read_file(filename, &size);
+    uint8_t *rows;
+    uint32_t r;
+
+    if ((file_data == NULL) || (size != PLT_HEADER_SIZE + row_size*height))
+    {
+        g_free(file_data);
+        return (NULL);
+    }
+    rows = (uint8_t*) g_malloc(row_size*height);
+    for (r = 0; r < height; r++)
+        memcpy(rows + r*row_size, file_data + PLT_HEADER_SIZE + (height - 1 - r)*row_size, row_size);
+    g_free(file_data);
+    return (rows);
+}
+
+
+// Straightforward version of plt_downsample: the most frequent layer id of
+// each 2x2 block (first one on a tie) with the mean value of its pixels
+static uint8_t *reference_downsample(const uint8_t *src, uint32_t width, uint32_t height)
+{
+    const uint32_t dst_width  = MAX(1, width/2);
+    const uint32_t dst_height = MAX(1, height/2);
+    uint8_t *dst = (uint8_t*) g_malloc(2 * (gsize) dst_width * dst_height);
+    uint8_t value[4], id[4];
+    uint32_t x, y, sx, sy;
+    gint k, c, count, best, best_count, sum;
+
+    for (y = 0; y < dst_height; y++)
+    {
+        for (x = 0; x < dst_width; x++)
+        {
+            for (k = 0; k < 4; k++)
+            {
+                sx = MIN(2*x + k%2, width - 1);
+                sy = MIN(2*y + k/2, height - 1);
+                value[k] = src[2*((gsize) sy*width + sx)];
+                id[k]    = src[2*((gsize) sy*width + sx) + 1];
+            }
+            best = 0;
+            best_count = 0;
+            for (k = 0; k < 4; k++)
+            {
+                count = 0;
+                for (c = 0; c < 4; c++)
+                    count += (id[c] == id[k]);
+                if (count > best_count)
+                {
+                    best = k;
+                    best_count = count;
+                }
+            }
+            sum = 0;
+            for (c = 0; c < 4; c++)
+                sum += (id[c] == id[best]) ? value[c] : 0;
+            dst[2*((gsize) y*dst_width + x)]     = (sum + best_count/2) / best_count;
+            dst[2*((gsize) y*dst_width + x) + 1] = id[best];
+        }
+    }
+    return (dst);
+}
+
+
+// Checks all levels of the mip chain saved with filename.plt
+static gboolean matches_mip_chain(const gchar *basename, uint32_t width, uint32_t height)
+{
+    gchar *filename = g_strdup_printf("%s.plt", basename);
+    uint8_t *level_data = read_plt_rows(filename, width, height);
+    uint8_t *expected, *actual;
+    gboolean result = (level_data != NULL);
+    gint level;
+
+    g_free(filename);
+    for (level = 1; result && ((width > 1) || (height > 1)); level++)
+    {
+        expected = reference_downsample(level_data, width, height);
+        g_free(level_data);
+        level_data = expected;
+        width  = MAX(1, width/2);
+        height = MAX(1, height/2);
+        filename = g_strdup_printf("%s_mip%d.plt", basename, level);
+        actual = read_plt_rows(filename, width, height);
+        result = (actual != NULL) && !memcmp(actual, expected, 2 * (gsize) width * height);
+        g_free(actual);
+        g_free(filename);
+    }
+    g_free(level_data);
+    // Nothing after the 1x1 level
+    filename = g_strdup_printf("%s_mip%d.plt", basename, level);
+    result = result && !g_file_test(filename, G_FILE_TEST_EXISTS);
+    g_free(filename);
+    return (result);
+}
+
+
+static void test_mipmaps(const gchar *dir)
+{
+    const gint sizes[][2] = {{37, 23}, {64, 64}, {1, 9}, {130, 67}, {300, 201}};
+    gchar *basename, *filename, *name;
+    gint32 image_id;
+    unsigned int s;
+
+    for (s = 0; s < G_N_ELEMENTS(sizes); s++)
+    {
+        // The largest one is saved in bands, which have to start at even rows
+        if (s == G_N_ELEMENTS(sizes) - 1)
+            g_setenv("PLT_MEMORY_BUDGET", "3000", TRUE);
+        image_id = gimp_image_new(sizes[s][0], sizes[s][1], GIMP_GRAY);
+        add_layer(image_id, "skin", sizes[s][0], sizes[s][1], GIMP_GRAY_IMAGE, 0, 0);
+        add_layer(image_id, "hair", sizes[s][0]/2 + 1, sizes[s][1]/2 + 1, GIMP_GRAYA_IMAGE, 3, 2);
+        name = g_strdup_printf("mip-%u", s);
+        basename = test_filename(dir, name);
+        filename = g_strdup_printf("%s.plt", basename);
+        CHECK((plt_save(filename, image_id, TRUE, NULL) == GIMP_PDB_SUCCESS) &&
+              matches_reference(image_id, filename) &&
+              matches_mip_chain(basename, sizes[s][0], sizes[s][1]),
+              "mip chain of %dx%d", sizes[s][0], sizes[s][1]);
+        gimp_image_delete(image_id);
+        g_free(filename);
+        g_free(basename);
+        g_free(name);
+        g_unsetenv("PLT_MEMORY_BUDGET");
+    }
+}
+
+
+// Calls a save procedure like gimp does, with the options only for the
+// save procedure which has them
+static GimpPDBStatusType run_save(const gchar *procedure, GimpRunMode run_mode,
+                                  gint32 image_id, const gchar *filename, gint mipmaps)
+{
+    GimpParam params[7];
+    GimpParam *return_values;
+    gint num_return_values;
+
+    params[0].type = GIMP_PDB_INT32;
+    params[0].data.d_int32 = run_mode;
+    params[1].type = GIMP_PDB_IMAGE;
+    params[1].data.d_image = image_id;
+    params[2].type = GIMP_PDB_DRAWABLE;
+    params[2].data.d_drawable = -1;
+    params[3].type = GIMP_PDB_STRING;
+    params[3].data.d_string = (gchar*) filename;
+    params[4].type = GIMP_PDB_STRING;
+    params[4].data.d_string = (gchar*) filename;
+    params[5].type = GIMP_PDB_INT32;
+    params[5].data.d_int32 = mipmaps;
+    params[6].type = GIMP_PDB_STRING;
+    params[6].data.d_string = NULL;
+    run(procedure, !g_strcmp0(procedure, SAVE2_PROCEDURE) ? 7 : 5, params,
+        &num_return_values, &return_values);
+    return (return_values[0].data.d_status);
+}
+
+
+// Mip maps are only saved when asked for, never by an interactive save
+static void test_save_options(const gchar *dir)
+{
+    gchar *filename, *mip_filename;
+    gint32 image_id;
+
+    image_id = gimp_image_new(8, 8, GIMP_GRAY);
+    add_layer(image_id, "skin", 8, 8, GIMP_GRAY_IMAGE, 0, 0);
+
+    filename = test_filename(dir, "options-script.plt");
+    mip_filename = test_filename(dir, "options-script_mip1.plt");
+    CHECK((run_save(SAVE2_PROCEDURE, GIMP_RUN_NONINTERACTIVE, image_id, filename, TRUE) == GIMP_PDB_SUCCESS) &&
+          g_file_test(mip_filename, G_FILE_TEST_EXISTS),
+          "non-interactive save with mipmaps");
+    g_free(mip_filename);
+    g_free(filename);
+
+    filename = test_filename(dir, "options-export.plt");
+    mip_filename = test_filename(dir, "options-export_mip1.plt");
+    CHECK((run_save(SAVE_PROCEDURE, GIMP_RUN_INTERACTIVE, image_id, filename, FALSE) == GIMP_PDB_SUCCESS) &&
+          !g_file_test(mip_filename, G_FILE_TEST_EXISTS),
+          "interactive save after a script save has no mipmaps");
+    g_free(mip_filename);
+    g_free(filename);
+
+    // The interactive save stored its own options
+    filename = test_filename(dir, "options-script.plt");
+    run_save(SAVE2_PROCEDURE, GIMP_RUN_NONINTERACTIVE, image_id, filename, TRUE);
+    g_free(filename);
+    filename = test_filename(dir, "options-repeat.plt");
+    mip_filename = test_filename(dir, "options-repeat_mip1.plt");
+    CHECK((run_save(SAVE_PROCEDURE, GIMP_RUN_WITH_LAST_VALS, image_id, filename, FALSE) == GIMP_PDB_SUCCESS) &&
+          g_file_test(mip_filename, G_FILE_TEST_EXISTS),
+          "repeated save uses the last options");
+    g_free(mip_filename);
+    g_free(filename);
+
+    // Scripts calling the save procedure with the standard arguments
+    filename = test_filename(dir, "options-standard.plt");
+    mip_filename = test_filename(dir, "options-standard_mip1.plt");
+    CHECK((run_save(SAVE_PROCEDURE, GIMP_RUN_NONINTERACTIVE, image_id, filename, TRUE) == GIMP_PDB_SUCCESS) &&
+          g_file_test(filename, G_FILE_TEST_EXISTS) &&
+          !g_file_test(mip_filename, G_FILE_TEST_EXISTS),
+          "non-interactive save with the standard arguments");
+    g_free(mip_filename);
+    g_free(filename);
+    gimp_image_delete(image_id);
+}
+
+
+// Pixel transfers start on a tile and end on a tile or at the edge of the
+// drawable, so gimp never splits tiles between calls
+static void test_tile_alignment(const gchar *dir)
+{
+    gchar *in_filename  = test_filename(dir, "tiles.plt");
+    gchar *out_filename = test_filename(dir, "tiles-saved.plt");
+    gint32 image_id = -1;
+
+    g_setenv("PLT_MEMORY_BUDGET", "3000", TRUE);
+    write_random_plt(in_filename, 200, 300, PLT_NUM_LAYERS);
+    stub_reset_counters();
+    plt_load(in_filename, &image_id);
+    CHECK(stub_counters.misaligned_rects == 0, "banded load is tile aligned");
+    gimp_image_delete(image_id);
+
+    image_id = gimp_image_new(200, 300, GIMP_RGB);
+    add_layer(image_id, "skin", 200, 300, GIMP_RGB_IMAGE, 0, 0);
+    add_layer(image_id, "hair", 150, 170, GIMP_RGBA_IMAGE, 37, -45);
+    add_layer(image_id, "metal1", 90, 400, GIMP_RGBA_IMAGE, -13, -61);
+    add_layer(image_id, "tattoo2", 10, 10, GIMP_RGBA_IMAGE, 195, 295);
+    stub_reset_counters();
+    CHECK((plt_save(out_filename, image_id, FALSE, NULL) == GIMP_PDB_SUCCESS) &&
+          matches_reference(image_id, out_filename) &&
+          (stub_counters.misaligned_rects == 0) && (stub_counters.invalid_rects == 0),
+          "banded save of offset layers is tile aligned");
+    gimp_image_delete(image_id);
+    g_unsetenv("PLT_MEMORY_BUDGET");
+    g_free(out_filename);
+    g_free(in_filename);
+}
+
+
+// Loaded layers are inserted once they are filled, with undo disabled
+static void test_load_layers(const gchar *dir)
+{
+    gchar *filename = test_filename(dir, "layers.plt");
+    gint32 image_id = -1;
+    gint num_layers, l;
+    gint *layer_ids;
+    gchar *name;
+    gboolean in_order = TRUE;
+
+    write_random_plt(filename, 70, 90, PLT_NUM_LAYERS);
+    stub_reset_counters();
+    CHECK((plt_load(filename, &image_id) == GIMP_PDB_SUCCESS) &&
+          (stub_counters.inserts_with_undo == 0) &&
+          stub_image_undo_is_enabled(image_id) &&
+          (stub_counters.live_drawables == 0),
+          "layers are inserted without undo");
+    // Skin at the bottom
+    layer_ids = gimp_image_get_layers(image_id, &num_layers);
+    for (l = 0; l < num_layers; l++)
+    {
+        name = gimp_item_get_name(layer_ids[l]);
+        in_order = in_order && !g_strcmp0(name, PLT_LAYERS[PLT_NUM_LAYERS - 1 - l]);
+        g_free(name);
+    }
+    CHECK((num_layers == PLT_NUM_LAYERS) && in_order, "layers are in plt order");
+    g_free(layer_ids);
+    gimp_image_delete(image_id);
+    g_free(filename);
+}
+
+
+// Copy of a plt with the value of some pixels changed, pixels are counted
+// in file order
+static void write_changed_plt(const gchar *src_filename, const gchar *dst_filename,
+                              const guint64 *pixels, gint num_pixels)
+{
+    gsize size;
+    uint8_t *data = read_file(src_filename, &size);
+    FILE *stream = g_fopen(dst_filename, "wb");
+    gint i;
+
+    for (i = 0; i < num_pixels; i++)
+        data[PLT_HEADER_SIZE + 2*pixels[i]] ^= 0x55;
+    fwrite(data, 1, size, stream);
+    fclose(stream);
+    g_free(data);
+}
+
+
+static gboolean has_version(const gchar *filename, const gchar *version)
+{
+    gsize size;
+    uint8_t *data = read_file(filename, &size);
+    gboolean result;
+
+    result = (data != NULL) && (size >= 8) && !memcmp(data, version, 8);
+    g_free(data);
+    return (result);
+}
+
+
+// Loads a plt and saves it again as a regular plt
+static gboolean resave_plt(const gchar *filename, const gchar *out_filename)
+{
+    gint32 image_id = -1;
+    GimpPDBStatusType status;
+
+    status = plt_load((gchar*) filename, &image_id);
+    if (status != GIMP_PDB_SUCCESS)
+        return FALSE;
+    status = plt_save((gchar*) out_filename, image_id, FALSE, NULL);
+    gimp_image_delete(image_id);
+    return (status == GIMP_PDB_SUCCESS);
+}
+
+
+// Delta plts only store the tiles which differ from their base
+static void test_delta(const gchar *dir)
+{
+    const uint32_t width = 200, height = 150;
+    const guint64 changed[] = {10*width + 10, 120*width + 150};
+    const guint64 base_changed[] = {100*width + 20};
+    gchar *base_filename    = test_filename(dir, "delta-base.plt");
+    gchar *frame_filename   = test_filename(dir, "delta-frame.plt");
+    gchar *delta_filename   = test_filename(dir, "delta.plt");
+    gchar *out_filename     = test_filename(dir, "delta-saved.plt");
+    gchar *other_filename   = test_filename(dir, "delta-other.plt");
+    gint32 image_id = -1;
+    gsize delta_size;
+    uint8_t *delta_data;
+
+    write_random_plt(base_filename, width, height, PLT_NUM_LAYERS);
+    write_changed_plt(base_filename, frame_filename, changed, G_N_ELEMENTS(changed));
+    plt_load(frame_filename, &image_id);
+    CHECK(plt_save(delta_filename, image_id, FALSE, "delta-base.plt") == GIMP_PDB_SUCCESS,
+          "save delta");
+    delta_data = read_file(delta_filename, &delta_size);
+    CHECK(has_version(delta_filename, PLT_DELTA_VERSION) &&
+          (delta_size < PLT_HEADER_SIZE + width*height),
+          "delta with 2 changed tiles has %u bytes", (guint) delta_size);
+    g_free(delta_data);
+    CHECK(resave_plt(delta_filename, out_filename) &&
+          same_files(frame_filename, out_filename),
+          "delta load -> save is byte identical to the frame");
+
+    // The base is read again on every load
+    write_changed_plt(frame_filename, frame_filename, base_changed, G_N_ELEMENTS(base_changed));
+    write_changed_plt(base_filename, base_filename, base_changed, G_N_ELEMENTS(base_changed));
+    CHECK(resave_plt(delta_filename, out_filename) &&
+          same_files(frame_filename, out_filename),
+          "changed base is used by the next load");
+
+    // Missing or mismatching bases
+    num_messages = 0;
+    CHECK((plt_save(delta_filename, image_id, FALSE, "delta-missing.plt") != GIMP_PDB_SUCCESS) &&
+          (num_messages > 0),
+          "delta with a missing base fails");
+    write_random_plt(other_filename, width, height + 1, PLT_NUM_LAYERS);
+    num_messages = 0;
+    CHECK((plt_save(delta_filename, image_id, FALSE, "delta-other.plt") != GIMP_PDB_SUCCESS) &&
+          (num_messages > 0),
+          "delta with a base of another size fails");
+    gimp_image_delete(image_id);
+
+    // Nothing in common with the base, a regular plt is smaller
+    write_random_plt(frame_filename, width, height, PLT_NUM_LAYERS);
+    image_id = -1;
+    plt_load(frame_filename, &image_id);
+    CHECK((plt_save(delta_filename, image_id, FALSE, "delta-base.plt") == GIMP_PDB_SUCCESS) &&
+          has_version(delta_filename, PLT_HEADER_VERSION) &&
+          same_files(frame_filename, delta_filename),
+          "delta with every tile changed is a regular plt");
+    gimp_image_delete(image_id);
+
+    g_free(other_filename);
+    g_free(out_filename);
+    g_free(delta_filename);
+    g_free(frame_filename);
+    g_free(base_filename);
+}
+
+
+// Saves replace the target through a temporary file next to it
+static void test_writer(const gchar *dir)
+{
+    gchar *writer_dir    = test_filename(dir, "writer");
+    gchar *filename      = g_build_filename(writer_dir, "mode.plt", NULL);
+    gchar *link_filename = g_build_filename(writer_dir, "link.plt", NULL);
+    gchar *link_target   = g_build_filename(writer_dir, "linked.plt", NULL);
+    gchar *dir_filename  = g_build_filename(writer_dir, "dir.plt", NULL);
+    const gchar *name;
+    gint32 image_id;
+    GStatBuf file_stat;
+    GDir *entries;
+    gint num_temp_files;
+
+    g_mkdir(writer_dir, 0777);
+    image_id = gimp_image_new(8, 8, GIMP_GRAY);
+    add_layer(image_id, "skin", 8, 8, GIMP_GRAY_IMAGE, 0, 0);
+
+    plt_save(filename, image_id, FALSE, NULL);
+    g_chmod(filename, 0640);
+    CHECK((plt_save(filename, image_id, FALSE, NULL) == GIMP_PDB_SUCCESS) &&
+          (g_stat(filename, &file_stat) == 0) && ((file_stat.st_mode & 0777) == 0640),
+          "permissions of the target are kept");
+
+    write_random_plt(link_target, 8, 8, PLT_NUM_LAYERS);
+    g_remove(link_filename);
+    CHECK((symlink("linked.plt", link_filename) == 0) &&
+          (plt_save(link_filename, image_id, FALSE, NULL) == GIMP_PDB_SUCCESS) &&
+          g_file_test(link_filename, G_FILE_TEST_IS_SYMLINK) &&
+          same_files(link_target, filename),
+          "symlink is kept and its target replaced");
+
+    // Renaming onto a directory fails after the temporary file is written
+    g_mkdir(dir_filename, 0777);
+    num_messages = 0;
+    CHECK((plt_save(dir_filename, image_id, FALSE, NULL) != GIMP_PDB_SUCCESS) &&
+          (num_messages > 0) && (strstr(last_message, g_strerror(EISDIR)) != NULL),
+          "save onto a directory fails with the error of the rename");
+    num_temp_files = 0;
+    entries = g_dir_open(writer_dir, 0, NULL);
+    while ((name = g_dir_read_name(entries)) != NULL)
+    {
+        if (strstr(name, ".plt.") != NULL)
+            num_temp_files++;
+    }
+    g_dir_close(entries);
+    CHECK(num_temp_files == 0, "no temporary files are left, %d found", num_temp_files);
+
+    gimp_image_delete(image_id);
+    g_free(dir_filename);
+    g_free(link_target);
+    g_free(link_filename);
+    g_free(filename);
+    g_free(writer_dir);
+}
+
+
+// Not a pass/fail test, timings depend on the machine
+static void test_throughput(const gchar *dir)
+{
+    const uint32_t size = 2048;
+    gchar *in_filename  = test_filename(dir, "throughput.plt");
+    gchar *out_filename = test_filename(dir, "throughput-saved.plt");
+    gchar *delta_filename = test_filename(dir, "throughput-delta.plt");
+    gint32 image_id = -1;
+    gint64 start;
+    gdouble load_time, save_time;
+
+    write_random_plt(in_filename, size, size, PLT_NUM_LAYERS);
+    stub_reset_counters();
+    start = g_get_monotonic_time();
+    plt_load(in_filename, &image_id);
+    load_time = seconds_since(start);
+    start = g_get_monotonic_time();
+    plt_save(out_filename, image_id, FALSE, NULL);
+    save_time = seconds_since(start);
+    CHECK(same_files(in_filename, out_filename), "round trip %ux%u", size, size);
+    g_print("        load %.1f Mpx/s, save %.1f Mpx/s, %d get_rect, %d set_rect\n",
+            size*size / load_time / 1e6, size*size / save_time / 1e6,
+            stub_counters.get_rect_calls, stub_counters.set_rect_calls);
+
+    // Delta against the file just saved, the base is in the page cache
+    plt_save(delta_filename, image_id, FALSE, "throughput-saved.plt");
+    gimp_image_delete(image_id);
+    image_id = -1;
+    start = g_get_monotonic_time();
+    plt_load(delta_filename, &image_id);
+    load_time = seconds_since(start);
+    g_print("        delta load %.1f Mpx/s\n", size*size / load_time / 1e6);
+    gimp_image_delete(image_id);
+    g_free(delta_filename);
+    g_free(out_filename);
+    g_free(in_filename);
+}
+
+
+int main(int argc, char **argv)
+{
+    if (argc != 2)
+    {
+        g_printerr("Usage: %s <output directory>\n", argv[0]);
+        return 2;
+    }
+    g_log_set_handler(NULL, G_LOG_LEVEL_MESSAGE, count_message, NULL);
+
+    test_round_trip(argv[1]);
+    test_layer_bounds(argv[1]);
+    test_unsupported_layers(argv[1]);
+    test_alpha_threshold(argv[1]);
+    test_unnamed_layers(argv[1]);
+    test_memory_budget(argv[1]);
+    test_duplicate_names(argv[1]);
+    test_invalid_files(argv[1]);
+    test_variants(argv[1], 90, 70, NULL);
+    test_variants(argv[1], 200, 300, "3000");
+    test_variants_errors(argv[1]);
+    test_mipmaps(argv[1]);
+    test_save_options(argv[1]);
+    test_tile_alignment(argv[1]);
+    test_load_layers(argv[1]);
+    test_delta(argv[1]);
+    test_writer(argv[1]);
+    test_throughput(argv[1]);
+
+    g_print("%d failed\n", num_failures);
+    return ((num_failures > 0) ? 1 : 0);
+}